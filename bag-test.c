@@ -11,6 +11,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/time.h>
 
 #include <err.h>
 #include <stdio.h>
@@ -22,6 +23,7 @@
 
 #include "bag.h"
 #include "parse.h"
+#include "perm.h"
 
 static void
 usage(void)
@@ -35,13 +37,19 @@ help(void)
 {
 	fprintf(stderr, "Commands:\n"
 	    "\tadd <range>\n"
+	    "\tbench [count]\n"
+	    "\tcheck\n"
 	    "\tcount\n"
+	    "\tdel <range>\n"
 	    "\tleft\n"
 	    "\tfirst\n"
 	    "\tlast\n"
 	    "\titer\n"
 	    "\tloop\n"
+	    "\tmap <file>\n"
 	    "\trefill\n"
+	    "\tsave <file>\n"
+	    "\tshard <n> [ports [threads [pos]]]\n"
 	    "\tshuffle\n"
 	    "\tquit\n");
 }
@@ -59,15 +67,208 @@ print_value(uint32_t value, void *arg)
 	return (0);
 }
 
+static void
+bench_report(const char *name, struct timeval *start, uint32_t n)
+{
+	struct timeval tv;
+	double secs;
+
+	gettimeofday(&tv, NULL);
+	timersub(&tv, start, &tv);
+	secs = (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+	
+	printf("%-8s %u values in %.3f s, %.2f Mvalues/s\n", name, n, secs,
+	    n / secs / 1000000.0);
+}
+
+static void
+bench(bag_t *bag, uint32_t n)
+{
+	struct timeval start;
+	uint32_t i, sum, values[64];
+	int j, cnt;
+
+	if (bag_count(bag) == 0) {
+		warnx("empty bag");
+		return;
+	}
+	if (n == 0)
+		n = 10000000;
+	
+	bag_refill(bag);
+	gettimeofday(&start, NULL);
+	for (i = sum = 0; i < n; i++) {
+		while (bag_iter(bag, &values[0]) < 0)
+			bag_refill(bag);
+		sum += values[0];
+	}
+	bench_report("iter", &start, n);
+	
+	bag_refill(bag);
+	gettimeofday(&start, NULL);
+	for (i = sum = 0; i < n; i += cnt) {
+		cnt = bag_cycle_batch(bag, values, 64);
+		for (j = 0; j < cnt; j++)
+			sum += values[j];
+	}
+	bench_report("batch", &start, i);
+	
+	bag_refill(bag);
+}
+
+static int
+cmp_value(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/* Walk the whole bag, sorted. */
+static uint32_t *
+collect(bag_t *bag, uint32_t n)
+{
+	uint32_t *values;
+
+	if ((values = malloc(n * sizeof(*values))) == NULL)
+		err(1, "malloc");
+	
+	bag_refill(bag);
+	if (bag_iter_batch(bag, values, n) != n || bag_left(bag) != 0)
+		errx(1, "short walk");
+	bag_refill(bag);
+	
+	qsort(values, n, sizeof(*values), cmp_value);
+	
+	return (values);
+}
+
+/* Check that a shuffled walk covers exactly the (unshuffled) bag. */
+static void
+check(bag_t *ref, rand_t *rnd)
+{
+	struct timeval start;
+	bag_t *bag;
+	uint32_t *want, *got, i, n, pos, value, at;
+
+	if ((n = bag_count(ref)) == 0) {
+		warnx("empty bag");
+		return;
+	}
+	want = collect(ref, n);
+	
+	if ((bag = bag_dup(ref)) == NULL)
+		err(1, "bag_dup");
+	bag_shuffle(bag, rnd);
+	
+	gettimeofday(&start, NULL);
+	got = collect(bag, n);
+	bench_report("tea", &start, n);
+	
+	for (i = 0; i < n && got[i] == want[i]; i++)
+		;
+	if (i < n)
+		printf("MISMATCH at %u: %u != %u\n", i, got[i], want[i]);
+	free(got);
+	
+	/* Each walk position maps to its member, and back. */
+	for (i = 0; i < n; i++) {
+		if (bag_iter(bag, &value) < 0 ||
+		    bag_at(bag, i, &at) < 0 || at != value ||
+		    bag_pos(bag, value, &pos) < 0 || pos != i) {
+			printf("BAD position %u\n", i);
+			break;
+		}
+	}
+	bag_close(bag);
+	free(want);
+}
+
+/*
+ * Deal the random walk of bag x ports from position pos out to n
+ * shards of m threads each, as a sharded scan resuming there would,
+ * and check that their union is exactly the rest of the unsharded
+ * walk, and that exactly one shard takes each input line.
+ */
+static void
+shard(bag_t *ref, rand_t *rnd, int nshards, uint32_t nports, int nthreads,
+    uint64_t pos)
+{
+	struct timeval start;
+	perm_t *perm;
+	u_char *seen;
+	uint64_t i, p, n, cnt, step;
+	uint32_t value;
+	int s, t, k;
+
+	n = (uint64_t)bag_count(ref) * nports;
+	
+	if (nshards < 1 || nthreads < 1 || n == 0 || n > (1 << 30)) {
+		warnx("need 1 or more shards and threads of 1 to 2^30 probes");
+		return;
+	}
+	if ((seen = calloc(n / 8 + 1, 1)) == NULL)
+		err(1, "calloc");
+	if ((perm = perm_open(n, rnd)) == NULL)
+		err(1, "perm_open");
+	
+	gettimeofday(&start, NULL);
+	for (s = cnt = 0; s < nshards; s++) {
+		for (t = 0; t < nthreads; t++) {
+			p = perm_slice(pos, s, nshards, t, nthreads, &step);
+			for ( ; p < n; p += step, cnt++) {
+				i = perm_get(perm, p);
+				if (i >= n ||
+				    (seen[i / 8] & (1 << (i % 8))) != 0 ||
+				    bag_index(ref, i / nports, &value) < 0) {
+					printf("BAD probe %llu in shard %d "
+					    "thread %d\n", (unsigned long long)i,
+					    s + 1, t + 1);
+					goto done;
+				}
+				seen[i / 8] |= 1 << (i % 8);
+			}
+		}
+	}
+	bench_report("shards", &start, cnt);
+	
+	for (p = 0; p < n; p++) {
+		i = perm_get(perm, p);
+		if (((seen[i / 8] & (1 << (i % 8))) != 0) != (p >= pos)) {
+			printf("%s probe %llu\n", p >= pos ? "MISSED" : "EXTRA",
+			    (unsigned long long)i);
+			goto done;
+		}
+		seen[i / 8] &= ~(1 << (i % 8));
+		
+		for (s = k = 0; s < nshards; s++) {
+			if (perm_slice(p, s, nshards, 0, 1, &step) == p)
+				k++;
+		}
+		if (k != 1) {
+			printf("BAD line %llu in %d shards\n",
+			    (unsigned long long)p, k);
+			goto done;
+		}
+	}
+	printf("%d shards x %d threads cover %llu probes from %llu\n",
+	    nshards, nthreads, (unsigned long long)cnt,
+	    (unsigned long long)pos);
+ done:
+	perm_close(perm);
+	free(seen);
+}
+
 int
 main(int argc, char *argv[])
 {
 	EditLine *el;
 	History *el_hist;
-	bag_t *bag;
+	bag_t *bag, *ref, *map;
 	rand_t *rnd;
 	uint32_t start, end;
-	char *p, *cmd;
+	char *p, *cmd, *arg[4];
+	int i;
 	
 	if (argc != 1)
 		usage();
@@ -80,6 +281,7 @@ main(int argc, char *argv[])
 	el_set(el, EL_HIST, history, el_hist);
 	
 	bag = bag_open();
+	ref = bag_open();
 	rnd = rand_open();
 
 	while ((p = (char *)el_gets(el, NULL)) != NULL) {
@@ -90,10 +292,22 @@ main(int argc, char *argv[])
 
 		if (strcmp(cmd, "add") == 0) {
 			if (parse_num_range(p, &start, &end) == 0) {
-				if (bag_add_range(bag, start, end) < 0)
+				if (bag_add_range(bag, start, end) < 0 ||
+				    bag_add_range(ref, start, end) < 0)
 					warn("bag_add_range");
 			} else
 				warnx("invalid range: %s", p);
+		} else if (strcmp(cmd, "bench") == 0) {
+			bench(bag, p != NULL ? atoi(p) : 0);
+		} else if (strcmp(cmd, "check") == 0) {
+			check(ref, rnd);
+		} else if (strcmp(cmd, "del") == 0) {
+			if (parse_num_range(p, &start, &end) == 0) {
+				if (bag_del_ranges(bag, &start, &end, 1) < 0 ||
+				    bag_del_ranges(ref, &start, &end, 1) < 0)
+					warn("bag_del_ranges");
+			} else
+				warnx("invalid range: %s", p);
 		} else if (strcmp(cmd, "count") == 0) {
 			print_value(bag_count(bag), NULL);
 		} else if (strcmp(cmd, "left") == 0) {
@@ -109,9 +323,36 @@ main(int argc, char *argv[])
 				print_value(start, NULL);
 		} else if (strcmp(cmd, "loop") == 0) {
 			bag_loop(bag, print_value, NULL);
+		} else if (strcmp(cmd, "map") == 0) {
+			if (p == NULL)
+				help();
+			else if ((map = bag_map(p)) == NULL)
+				warn("couldn't map %s", p);
+			else {
+				bag_close(bag);
+				bag_close(ref);
+				bag = map;
+				ref = bag_dup(map);
+			}
 		} else if (strcmp(cmd, "refill") == 0) {
 			if (bag_refill(bag) < 0)
 				warn("bag_refill");
+		} else if (strcmp(cmd, "save") == 0) {
+			if (p == NULL)
+				help();
+			else if (bag_save(bag, p) < 0)
+				warn("couldn't save %s", p);
+		} else if (strcmp(cmd, "shard") == 0) {
+			arg[0] = NULL;
+			arg[1] = arg[2] = "1";
+			arg[3] = "0";
+			for (i = 0; i < 4 && p != NULL; i++)
+				arg[i] = strsep(&p, " \t");
+			if (arg[0] == NULL)
+				help();
+			else
+				shard(ref, rnd, atoi(arg[0]), atoi(arg[1]),
+				    atoi(arg[2]), strtoull(arg[3], NULL, 10));
 		} else if (strcmp(cmd, "shuffle") == 0) {
 			if (bag_shuffle(bag, rnd) < 0)
 				warn("bag_shuffle");
@@ -127,6 +368,7 @@ main(int argc, char *argv[])
 	el_end(el);
 
 	bag_close(bag);
+	bag_close(ref);
 
 	exit(0);
 }
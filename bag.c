@@ -11,12 +11,15 @@
 #endif
 
 #include <sys/types.h>
-#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <dnet.h>
 
@@ -27,293 +30,767 @@
 #define TEASBOXSIZE		 128
 #define TEASBOXSHIFT		 7
 
-struct bag_list {
-	uint32_t		*base;		/* list head */
-	uint32_t		 cur;		/* current index */
-	uint32_t		 nmemb;		/* number of members */
-	uint32_t		 max;		/* max allocated index */
+/*
+ * A bag is a set of values, kept as a contiguous array of ranges. Adds
+ * are appended as they come; the first lookup after them sorts and
+ * merges the array, and sums up how many members precede each range,
+ * so that counting is O(1) and finding the i'th member O(log n).
+ * Shuffling permutes the member indices [0, count) as a whole.
+ *
+ * A bag saved to a file is mapped back in read-only as is: a header,
+ * its ranges, then its single members as a sorted array (at a third
+ * the size of a range each), which follow the ranges in index order.
+ * We copy a mapped bag into memory only if it's changed.
+ */
+#define BAG_MAGIC		"DSCANBAG"
+#define BAG_VERSION		1
+
+struct bag_hdr {
+	char			 magic[8];	/* BAG_MAGIC */
+	uint32_t		 version;	/* BAG_VERSION, our byte order */
+	uint32_t		 rvcnt;		/* ranges */
+	uint32_t		 svcnt;		/* single members */
+	uint32_t		 count;		/* all members */
 };
 
 struct bag_range {
-	uint32_t		 start;		/* range start */
-	uint32_t		 cur;		/* current index */
-	uint32_t		 enc;		/* encryption state */
-	uint32_t		 nmemb;		/* range length */
-	TAILQ_ENTRY(bag_range)	 next;
+	uint32_t		 start;		/* first member */
+	uint32_t		 end;		/* last member */
+	uint32_t		 off;		/* members before this range */
 };
 
 struct bag {
-	struct bag_list		 list;
-	TAILQ_HEAD(bag_range_head, bag_range)	 ranges;
+	struct bag_range	*rv;		/* ranges */
+	uint32_t		 rvcnt;
+	uint32_t		 rvmax;
+	uint32_t		*sv;		/* single members, after ranges */
+	uint32_t		 svcnt;
+	uint32_t		 count;		/* members, once sorted */
+	int			 sorted;	/* no adds since last sort */
+	void			*map;		/* file mapping */
+	size_t			 maplen;
+	int			 mapfd;
+
+	uint32_t		 cur;		/* members iterated */
+	uint32_t		 ri;		/* range of the last one */
+
 	rand_t			*rnd;
 	uint32_t		 sbox[TEASBOXSIZE];
 };
 
 bag_t *
 bag_open(void)
+{
+	return (calloc(1, sizeof(struct bag)));
+}
+
+static int
+_bag_range_cmp(const void *a, const void *b)
+{
+	const struct bag_range *x = a, *y = b;
+
+	return (x->start < y->start ? -1 : x->start > y->start);
+}
+
+/* Sort and merge our ranges, if we've added any since last time. */
+static void
+_bag_sort(bag_t *bag)
+{
+	struct bag_range *br;
+	uint32_t i, j;
+
+	if (bag->sorted)
+		return;
+
+	qsort(bag->rv, bag->rvcnt, sizeof(*bag->rv), _bag_range_cmp);
+
+	for (i = j = 0; i < bag->rvcnt; i++) {
+		br = &bag->rv[i];
+
+		if (j > 0 && br->start <= (uint64_t)bag->rv[j - 1].end + 1) {
+			if (br->end > bag->rv[j - 1].end)
+				bag->rv[j - 1].end = br->end;
+		} else
+			bag->rv[j++] = *br;
+	}
+	bag->rvcnt = j;
+	bag->count = 0;
+
+	for (i = 0; i < bag->rvcnt; i++) {
+		bag->rv[i].off = bag->count;
+		bag->count += bag->rv[i].end - bag->rv[i].start + 1;
+	}
+	bag->count += bag->svcnt;
+	bag->sorted = 1;
+
+	bag_refill(bag);
+}
+
+static int
+_bag_map(bag_t *bag)
+{
+	struct bag_hdr *hdr;
+	struct stat st;
+	uint64_t len;
+
+	if (fstat(bag->mapfd, &st) < 0)
+		return (-1);
+	if (st.st_size < sizeof(*hdr)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	bag->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+	    bag->mapfd, 0);
+	if (bag->map == MAP_FAILED) {
+		bag->map = NULL;
+		return (-1);
+	}
+	bag->maplen = st.st_size;
+	hdr = bag->map;
+	
+	bag->rv = (struct bag_range *)(hdr + 1);
+	bag->rvcnt = bag->rvmax = hdr->rvcnt;
+	bag->sv = (uint32_t *)(bag->rv + hdr->rvcnt);
+	bag->svcnt = hdr->svcnt;
+	bag->count = hdr->count;
+	bag->sorted = 1;
+	
+	len = sizeof(*hdr) + (uint64_t)hdr->rvcnt * sizeof(*bag->rv) +
+	    (uint64_t)hdr->svcnt * sizeof(*bag->sv);
+	
+	if (memcmp(hdr->magic, BAG_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->version != BAG_VERSION || len != bag->maplen ||
+	    (bag->rvcnt > 0 ? bag->rv[bag->rvcnt - 1].off +
+	    (bag->rv[bag->rvcnt - 1].end - bag->rv[bag->rvcnt - 1].start + 1) :
+	    0) != bag->count - bag->svcnt) {
+		munmap(bag->map, bag->maplen);
+		bag->map = NULL;
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/* Map a saved bag in read-only. */
+bag_t *
+bag_map(const char *file)
 {
 	bag_t *bag;
 
-	if ((bag = calloc(1, sizeof(*bag))) != NULL) {
-		TAILQ_INIT(&bag->ranges);
+	if ((bag = bag_open()) == NULL)
+		return (NULL);
+	
+	if ((bag->mapfd = open(file, O_RDONLY)) < 0) {
+		free(bag);
+		return (NULL);
+	}
+	if (_bag_map(bag) < 0) {
+		close(bag->mapfd);
+		free(bag);
+		return (NULL);
 	}
 	return (bag);
 }
 
+/* Copy a mapped bag into memory, to change it. */
 static int
-_bag_add_list(bag_t *bag, uint32_t val)
+_bag_unmap(bag_t *bag)
 {
-	uint32_t *p;
+	struct bag_range *rv = NULL;
+	uint32_t *sv = NULL;
 
-	if (bag->list.base == NULL) {
-		if ((bag->list.base = malloc(BUFSIZ)) == NULL)
-			return (-1);
-		bag->list.max = BUFSIZ / sizeof(val);
-	} else if (bag->list.nmemb == bag->list.max) {
-		bag->list.max <<= 1;
-		if ((p = realloc(bag->list.base, bag->list.max)) == NULL)
-			return (-1);
-		bag->list.base = p;
+	if (bag->map == NULL)
+		return (0);
+	
+	if ((bag->rvcnt > 0 &&
+	    (rv = malloc(bag->rvcnt * sizeof(*rv))) == NULL) ||
+	    (bag->svcnt > 0 &&
+	    (sv = malloc(bag->svcnt * sizeof(*sv))) == NULL)) {
+		if (rv != NULL)
+			free(rv);
+		return (-1);
 	}
-	bag->list.base[bag->list.nmemb++] = val;
+	if (rv != NULL)
+		memcpy(rv, bag->rv, bag->rvcnt * sizeof(*rv));
+	if (sv != NULL)
+		memcpy(sv, bag->sv, bag->svcnt * sizeof(*sv));
+	
+	munmap(bag->map, bag->maplen);
+	close(bag->mapfd);
+	bag->map = NULL;
+	
+	bag->rv = rv;
+	bag->rvmax = bag->rvcnt;
+	bag->sv = sv;
+	
+	return (0);
+}
+
+/* Save a bag, to be mapped back in later. */
+int
+bag_save(bag_t *bag, const char *file)
+{
+	struct bag_hdr hdr;
+	struct bag_range br;
+	FILE *fp;
+	char tmp[1024];
+	uint32_t i, j, v;
+
+	_bag_sort(bag);
+	
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BAG_MAGIC, sizeof(hdr.magic));
+	hdr.version = BAG_VERSION;
+	hdr.svcnt = bag->svcnt;
+	hdr.count = bag->count;
+	
+	for (i = 0; i < bag->rvcnt; i++) {
+		if (bag->rv[i].start == bag->rv[i].end)
+			hdr.svcnt++;
+		else
+			hdr.rvcnt++;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return (-1);
+	
+	fwrite(&hdr, sizeof(hdr), 1, fp);
 	
+	for (i = 0, br.off = 0; i < bag->rvcnt; i++) {
+		if (bag->rv[i].start == bag->rv[i].end)
+			continue;
+		br.start = bag->rv[i].start;
+		br.end = bag->rv[i].end;
+		fwrite(&br, sizeof(br), 1, fp);
+		br.off += br.end - br.start + 1;
+	}
+	/* Merge our single members, from both places we keep them. */
+	for (i = j = 0; i < bag->rvcnt || j < bag->svcnt; ) {
+		if (i < bag->rvcnt && bag->rv[i].start != bag->rv[i].end) {
+			i++;
+			continue;
+		}
+		if (j < bag->svcnt &&
+		    (i == bag->rvcnt || bag->sv[j] < bag->rv[i].start))
+			v = bag->sv[j++];
+		else
+			v = bag->rv[i++].start;
+		
+		fwrite(&v, sizeof(v), 1, fp);
+	}
+	if (ferror(fp) || fclose(fp) != 0 || rename(tmp, file) < 0) {
+		unlink(tmp);
+		return (-1);
+	}
 	return (0);
 }
 
+/* Copy a bag's members and order, with its own iteration state. */
+bag_t *
+bag_dup(bag_t *bag)
+{
+	bag_t *dup;
+
+	_bag_sort(bag);
+
+	if ((dup = bag_open()) == NULL)
+		return (NULL);
+
+	memcpy(dup, bag, sizeof(*dup));
+	
+	if (bag->map != NULL) {
+		/* Share the page cache, not our mapping. */
+		if ((dup->mapfd = fcntl(bag->mapfd, F_DUPFD, 0)) < 0) {
+			free(dup);
+			return (NULL);
+		}
+		if (_bag_map(dup) < 0) {
+			close(dup->mapfd);
+			free(dup);
+			return (NULL);
+		}
+		bag_refill(dup);
+		return (dup);
+	}
+	dup->rv = NULL;
+	dup->sv = NULL;
+	dup->rvmax = bag->rvcnt;
+
+	if (bag->rvcnt > 0) {
+		if ((dup->rv = malloc(bag->rvcnt * sizeof(*dup->rv))) == NULL)
+			return (bag_close(dup));
+		memcpy(dup->rv, bag->rv, bag->rvcnt * sizeof(*dup->rv));
+	}
+	if (bag->svcnt > 0) {
+		if ((dup->sv = malloc(bag->svcnt * sizeof(*dup->sv))) == NULL)
+			return (bag_close(dup));
+		memcpy(dup->sv, bag->sv, bag->svcnt * sizeof(*dup->sv));
+	}
+	bag_refill(dup);
+
+	return (dup);
+}
+
 int
 bag_add(bag_t *bag, uint32_t value)
 {
-	return (_bag_add_list(bag, value));
+	return (bag_add_range(bag, value, value));
 }
 
 int
 bag_add_range(bag_t *bag, uint32_t start, uint32_t end)
 {
-	struct bag_range *br;
-	uint32_t i;
-	int ret = -1;
+	struct bag_range *rv;
+	uint32_t i, n, *sv;
+	int ret = 0;
+
+	if (start > end) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (_bag_unmap(bag) < 0)
+		return (-1);
+	
+	/* Fold in any single members, to merge them with ours. */
+	if ((sv = bag->sv) != NULL) {
+		n = bag->svcnt;
+		bag->sv = NULL;
+		bag->svcnt = 0;
+		
+		for (i = 0; i < n && ret == 0; i++)
+			ret = bag_add_range(bag, sv[i], sv[i]);
+		free(sv);
+		
+		if (ret < 0)
+			return (-1);
+	}
+	if (bag->rvcnt == bag->rvmax) {
+		bag->rvmax = bag->rvmax ? bag->rvmax << 1 : 16;
+		if ((rv = realloc(bag->rv, bag->rvmax * sizeof(*rv))) == NULL)
+			return (-1);
+		bag->rv = rv;
+	}
+	bag->rv[bag->rvcnt].start = start;
+	bag->rv[bag->rvcnt].end = end;
+	bag->rvcnt++;
+	bag->sorted = 0;
+
+	return (0);
+}
+
+/*
+ * Remove n sorted, disjoint ranges from the bag. Each of our ranges is
+ * split around the ones it overlaps, found by binary search, so this
+ * is cheap however many there are.
+ */
+int
+bag_del_ranges(bag_t *bag, const uint32_t *start, const uint32_t *end,
+    uint32_t n)
+{
+	struct bag_range *rv;
+	uint32_t i, j, lo, hi, cnt, cur, last, svcnt, *sv;
+	uint64_t stop;
+
+	_bag_sort(bag);
+
+	if (_bag_unmap(bag) < 0)
+		return (-1);
 	
-	if (start == end) {
-		ret = _bag_add_list(bag, start);
-	} else if (end - start <= 4) {
-		ret = 0;
-		for (i = start; ret == 0 && i <= end; i++) {
-			if (_bag_add_list(bag, i) < 0)
-				ret = -1;
+	/* Drop single members in any range. */
+	for (i = j = 0; i < bag->svcnt; i++) {
+		for (lo = 0, hi = n; lo < hi; ) {
+			if (end[lo + (hi - lo) / 2] < bag->sv[i])
+				lo += (hi - lo) / 2 + 1;
+			else
+				hi = lo + (hi - lo) / 2;
 		}
-	} else if (start < end && (br = calloc(1, sizeof(*br))) != NULL) {
-		br->start = start;
-		br->nmemb = end - start + 1;
-		TAILQ_INSERT_TAIL(&bag->ranges, br, next);
-		ret = 0;
+		if (lo == n || start[lo] > bag->sv[i])
+			bag->sv[j++] = bag->sv[i];
 	}
-	return (ret);
+	/* Set them aside, while we rebuild our ranges. */
+	sv = bag->sv;
+	svcnt = j;
+	bag->sv = NULL;
+	bag->svcnt = 0;
+	
+	rv = bag->rv;
+	cnt = bag->rvcnt;
+	bag->rv = NULL;
+	bag->rvcnt = bag->rvmax = 0;
+
+	while (cnt-- > 0) {
+		cur = rv[cnt].start;
+		last = rv[cnt].end;
+
+		for (lo = 0, hi = n; lo < hi; ) {
+			if (end[lo + (hi - lo) / 2] < cur)
+				lo += (hi - lo) / 2 + 1;
+			else
+				hi = lo + (hi - lo) / 2;
+		}
+		for (i = lo; cur <= last; i++) {
+			stop = i < n && start[i] <= last ? start[i] :
+			    (uint64_t)last + 1;
+
+			if (stop > cur &&
+			    bag_add_range(bag, cur, (uint32_t)(stop - 1)) < 0) {
+				free(rv);
+				if (sv != NULL)
+					free(sv);
+				return (-1);
+			}
+			if (i >= n || start[i] > last || end[i] >= last)
+				break;
+			cur = end[i] + 1;
+		}
+	}
+	free(rv);
+
+	bag->sv = sv;
+	bag->svcnt = svcnt;
+	bag->sorted = 0;
+	_bag_sort(bag);
+
+	return (0);
 }
 
 uint32_t
 bag_count(bag_t *bag)
 {
-	struct bag_list *bl = &bag->list;
-        struct bag_range *br;
-	uint32_t i = 0;
+	_bag_sort(bag);
 
-	i += bl->nmemb;
-	
-	TAILQ_FOREACH(br, &bag->ranges, next) {
-		i += br->nmemb;
-	}
-	return (i);
+	return (bag->count);
 }
 
 uint32_t
 bag_left(bag_t *bag)
 {
-	struct bag_list *bl = &bag->list;
-	struct bag_range *br;
-	uint32_t i = 0;
+	_bag_sort(bag);
 
-	i += bl->nmemb - bl->cur;
-
-	TAILQ_FOREACH(br, &bag->ranges, next) {
-		i += br->nmemb - br->cur;
-	}
-	return (i);
+	return (bag->count - bag->cur);
 }
 
 int
 bag_shuffle(bag_t *bag, rand_t *rnd)
 {
 	int ret;
-	
+
+	_bag_sort(bag);
 	bag->rnd = rnd;
-	
-	if ((ret = rand_get(bag->rnd, bag->sbox, sizeof(bag->sbox))) == 0) {
+
+	if ((ret = rand_get(bag->rnd, bag->sbox, sizeof(bag->sbox))) == 0)
 		bag_refill(bag);
-		ret = rand_shuffle(bag->rnd, bag->list.base,
-		    bag->list.nmemb, sizeof(*bag->list.base));
-	} else
+	else
 		bag->rnd = NULL;
-	
+
 	return (ret);
 }
 
 /* Modified (variable block length) TEA by Niels Provos <provos@monkey.org> */
 
+struct bag_tea {
+	uint32_t		 left;
+	uint32_t		 right;
+	uint32_t		 mask;
+	uint32_t		 sboxmask;
+	uint32_t		 kshift;
+};
+
+static void
+_bag_tea_init(struct bag_tea *tea, uint32_t nmemb)
+{
+	uint32_t bits;
+
+	for (bits = 0; nmemb > (1ULL << bits); bits++)
+		;
+
+	tea->left = bits / 2;
+	tea->right = bits - tea->left;
+	tea->mask = (uint32_t)((1ULL << bits) - 1);
+
+	if (TEASBOXSIZE < (1 << tea->left)) {
+		tea->sboxmask = TEASBOXSIZE - 1;
+		tea->kshift = TEASBOXSHIFT;
+	} else {
+		tea->sboxmask = (1 << tea->left) - 1;
+		tea->kshift = tea->left;
+	}
+}
+
 static uint32_t
-_bag_iter(bag_t *bag, uint32_t enc, uint32_t nmemb)
+_bag_tea(bag_t *bag, struct bag_tea *tea, uint32_t enc)
 {
-	uint32_t bits, mask, sboxmask, sum = 0;
-	int i, left, right, kshift;
-	
+	uint32_t sum = 0;
+	int i;
+
 	if (bag->rnd != NULL) {
-		for (bits = 0; nmemb > (1 << bits); bits++)
-			;
-
-		left = bits / 2;
-		right = bits - left;
-		mask = (1 << bits) - 1;
-
-		if (TEASBOXSIZE < (1 << left)) {
-			sboxmask = TEASBOXSIZE - 1;
-			kshift = TEASBOXSHIFT;
-		} else {
-			sboxmask = (1 << left) - 1;
-			kshift = left;
-		}
 		for (i = 0; i < TEAROUNDS; i++) {
 			sum += TEADELTA;
-			enc ^= bag->sbox[(enc ^ sum) & sboxmask] << kshift;
+			enc ^= bag->sbox[(enc ^ sum) & tea->sboxmask] <<
+			    tea->kshift;
 			enc += sum;
-			enc &= mask;
-			enc = ((enc << left) | (enc >> right)) & mask;
+			enc &= tea->mask;
+			enc = ((enc << tea->left) | (enc >> tea->right)) &
+			    tea->mask;
 		}
 	}
 	return (enc);
 }
 
-int
-bag_first(bag_t *bag, uint32_t *first)
+static uint32_t
+_bag_untea(bag_t *bag, struct bag_tea *tea, uint32_t dec)
 {
-	struct bag_list *bl = &bag->list;
-	struct bag_range *br;
-	int i, enc;
+	uint32_t sum = TEADELTA * TEAROUNDS;
+	int i;
+
+	if (bag->rnd != NULL) {
+		for (i = 0; i < TEAROUNDS; i++) {
+			dec = ((dec >> tea->left) | (dec << tea->right)) &
+			    tea->mask;
+			dec = (dec - sum) & tea->mask;
+			dec ^= bag->sbox[(dec ^ sum) & tea->sboxmask] <<
+			    tea->kshift;
+			dec &= tea->mask;
+			sum -= TEADELTA;
+		}
+	}
+	return (dec);
+}
+
+/*
+ * TEA permutes [0, mask], less than twice our count. Cycle-walking
+ * each position back into [0, count) makes it a permutation of the
+ * bag as well, so any position maps to its member index (and back)
+ * in a couple of rounds on average, without walking up to it.
+ */
+static uint32_t
+_bag_perm(bag_t *bag, struct bag_tea *tea, uint32_t pos)
+{
+	do {
+		pos = _bag_tea(bag, tea, pos);
+	} while (pos >= bag->count);
+
+	return (pos);
+}
+
+static uint32_t
+_bag_unperm(bag_t *bag, struct bag_tea *tea, uint32_t i)
+{
+	do {
+		i = _bag_untea(bag, tea, i);
+	} while (i >= bag->count);
+
+	return (i);
+}
+
+/* Return the i'th member, looking near range ri first. */
+static uint32_t
+_bag_value(bag_t *bag, uint32_t i, uint32_t *ri)
+{
+	struct bag_range *br = &bag->rv[*ri];
+	uint32_t lo, hi, mid;
+
+	/* Single members follow our ranges. */
+	if (i >= bag->count - bag->svcnt)
+		return (bag->sv[i - (bag->count - bag->svcnt)]);
 	
-	if (bl->nmemb > 0) {
-		*first = bl->base[0];
-	} else if ((br = TAILQ_FIRST(&bag->ranges)) != NULL) {
-		i = enc = 0;
-		if (bag->rnd != NULL) {
-			do {
-				i = _bag_iter(bag, enc++, br->nmemb);
-			} while (i >= br->nmemb);
+	if (i < br->off || i - br->off > br->end - br->start) {
+		for (lo = 0, hi = bag->rvcnt; hi - lo > 1; ) {
+			mid = lo + (hi - lo) / 2;
+			if (bag->rv[mid].off <= i)
+				lo = mid;
+			else
+				hi = mid;
 		}
-		*first = br->start + i;
-	} else
+		*ri = lo;
+		br = &bag->rv[lo];
+	}
+	return (br->start + (i - br->off));
+}
+
+/* Return the sorted index of a member, by binary search. */
+static int
+_bag_find(bag_t *bag, uint32_t value, uint32_t *i)
+{
+	uint32_t lo, hi, mid;
+
+	for (lo = 0, hi = bag->rvcnt; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (bag->rv[mid].end < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < bag->rvcnt && bag->rv[lo].start <= value) {
+		*i = bag->rv[lo].off + (value - bag->rv[lo].start);
+		return (0);
+	}
+	for (lo = 0, hi = bag->svcnt; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (bag->sv[mid] < value)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < bag->svcnt && bag->sv[lo] == value) {
+		*i = bag->count - bag->svcnt + lo;
+		return (0);
+	}
+	return (-1);
+}
+
+int
+bag_first(bag_t *bag, uint32_t *first)
+{
+	struct bag_tea tea;
+	uint32_t ri = 0;
+
+	if (bag_count(bag) == 0)
 		return (-1);
-	
+
+	_bag_tea_init(&tea, bag->count);
+	*first = _bag_value(bag, _bag_perm(bag, &tea, 0), &ri);
+
 	return (0);
 }
 
 int
 bag_last(bag_t *bag, uint32_t *last)
 {
-	struct bag_list *bl = &bag->list;
-	struct bag_range *br;
-	int cur, enc, i = 0;
-	
-	if ((br = TAILQ_LAST(&bag->ranges, bag_range_head)) != NULL) {
-		if (bag->rnd != NULL) {
-			for (cur = enc = 0; cur < br->nmemb; cur++) {
-				do {
-					i = _bag_iter(bag, enc++, br->nmemb);
-				} while (i >= br->nmemb);
-			}
-		} else
-			i = br->nmemb - 1;
-		
-		*last = br->start + i;
-	} else if (bl->nmemb > 0) {
-		*last = bl->base[bl->nmemb - 1];
-	} else
+	struct bag_tea tea;
+	uint32_t ri = 0;
+
+	if (bag_count(bag) == 0)
 		return (-1);
-	
+
+	_bag_tea_init(&tea, bag->count);
+	*last = _bag_value(bag, _bag_perm(bag, &tea, bag->count - 1), &ri);
+
 	return (0);
 }
-	
+
+/* Return the i'th member, in sorted order (ranges first, if mapped). */
+int
+bag_index(bag_t *bag, uint32_t i, uint32_t *value)
+{
+	uint32_t ri = 0;
+
+	if (i >= bag_count(bag))
+		return (-1);
+
+	*value = _bag_value(bag, i, &ri);
+
+	return (0);
+}
+
+/* Return the position of a member in our walk. */
+int
+bag_pos(bag_t *bag, uint32_t value, uint32_t *pos)
+{
+	struct bag_tea tea;
+
+	_bag_sort(bag);
+
+	if (_bag_find(bag, value, pos) < 0)
+		return (-1);
+
+	_bag_tea_init(&tea, bag->count);
+	*pos = _bag_unperm(bag, &tea, *pos);
+
+	return (0);
+}
+
+/* Return the member at a position in our walk. */
+int
+bag_at(bag_t *bag, uint32_t pos, uint32_t *value)
+{
+	struct bag_tea tea;
+	uint32_t ri = 0;
+
+	if (pos >= bag_count(bag))
+		return (-1);
+
+	_bag_tea_init(&tea, bag->count);
+	*value = _bag_value(bag, _bag_perm(bag, &tea, pos), &ri);
+
+	return (0);
+}
+
 int
 bag_iter(bag_t *bag, uint32_t *value)
 {
-	struct bag_list *bl = &bag->list;
-	struct bag_range *br;
-	int i;
-	
-	if (bl->cur < bl->nmemb) {
-		*value = bl->base[bl->cur++];
-		return (0);
+	return (bag_iter_batch(bag, value, 1) == 1 ? 0 : -1);
+}
+
+/* Fill values[] with up to n more values, returning how many we got. */
+int
+bag_iter_batch(bag_t *bag, uint32_t *values, int n)
+{
+	struct bag_tea tea;
+	int cnt;
+
+	_bag_sort(bag);
+	_bag_tea_init(&tea, bag->count);
+
+	for (cnt = 0; cnt < n && bag->cur < bag->count; cnt++, bag->cur++) {
+		values[cnt] = _bag_value(bag,
+		    _bag_perm(bag, &tea, bag->cur), &bag->ri);
 	}
-	for (br = TAILQ_FIRST(&bag->ranges); br; br = TAILQ_NEXT(br, next)) {
-		if (br->cur < br->nmemb) {
-			br->cur++;
-			do {
-				i = _bag_iter(bag, br->enc++, br->nmemb);
-			} while (i >= br->nmemb);
-			
-			*value = br->start + i;
-			return (0);
-		}
+	return (cnt);
+}
+
+/* Fill values[] with the next n values, starting over as needed. */
+int
+bag_cycle_batch(bag_t *bag, uint32_t *values, int n)
+{
+	int i, cnt;
+
+	if (bag_count(bag) == 0)
+		return (-1);
+
+	for (cnt = 0; cnt < n; cnt += i) {
+		if ((i = bag_iter_batch(bag, values + cnt, n - cnt)) == 0)
+			bag_refill(bag);
 	}
-	return (-1);
+	return (cnt);
 }
 
 int
 bag_loop(bag_t *bag, bag_handler callback, void *arg)
 {
-	struct bag_list *bl;
-	struct bag_range *br;
-	int i, ret;
+	uint32_t value;
+	int ret;
 
-	for (bl = &bag->list; bl->cur < bl->nmemb; bl->cur++) {
-		if ((ret = callback(bl->base[bl->cur], arg)) != 0)
+	while (bag_iter(bag, &value) == 0) {
+		if ((ret = callback(value, arg)) != 0)
 			return (ret);
 	}
-	for (br = TAILQ_FIRST(&bag->ranges); br; br = TAILQ_NEXT(br, next)) {
-		for ( ; br->cur < br->nmemb; br->cur++) {
-			do {
-				i = _bag_iter(bag, br->enc++, br->nmemb);
-			} while (i >= br->nmemb);
-			
-			if ((ret = callback(br->start + i, arg)) != 0)
-				return (ret);
-		}
-	}
 	return (0);
 }
 
 int
 bag_refill(bag_t *bag)
 {
-	struct bag_range *br;
-	
-	bag->list.cur = 0;
+	bag->cur = bag->ri = 0;
 
-	TAILQ_FOREACH(br, &bag->ranges, next) {
-		br->cur = 0;
-		br->enc = 0;
-	}
 	return (0);
 }
-	
+
 bag_t *
 bag_close(bag_t *bag)
 {
-	struct bag_range *br;
-
-	if (bag->list.base != NULL)
-		free(bag->list.base);
-	
-	while ((br = TAILQ_FIRST(&bag->ranges)) != NULL) {
-		TAILQ_REMOVE(&bag->ranges, br, next);
-		free(br);
+	if (bag->map != NULL) {
+		munmap(bag->map, bag->maplen);
+		close(bag->mapfd);
+	} else {
+		if (bag->rv != NULL)
+			free(bag->rv);
+		if (bag->sv != NULL)
+			free(bag->sv);
 	}
 	free(bag);
 
@@ -11,12 +11,18 @@
 
 typedef struct bag bag_t;
 
+
 typedef int (*bag_handler)(uint32_t value, void *arg);
 
 bag_t	*bag_open(void);
+bag_t	*bag_dup(bag_t *b);
+bag_t	*bag_map(const char *file);
+int	 bag_save(bag_t *b, const char *file);
 
 int	 bag_add(bag_t *b, uint32_t value);
 int	 bag_add_range(bag_t *b, uint32_t start, uint32_t end);
+int	 bag_del_ranges(bag_t *b, const uint32_t *start, const uint32_t *end,
+	    uint32_t n);
 
 uint32_t bag_count(bag_t *b);
 uint32_t bag_left(bag_t *b);
@@ -25,7 +31,12 @@ int	 bag_shuffle(bag_t *b, rand_t *rnd);
 
 int	 bag_first(bag_t *b, uint32_t *first);
 int	 bag_last(bag_t *b, uint32_t *last);
+int	 bag_index(bag_t *b, uint32_t i, uint32_t *value);
+int	 bag_pos(bag_t *b, uint32_t value, uint32_t *pos);
+int	 bag_at(bag_t *b, uint32_t pos, uint32_t *value);
 int	 bag_iter(bag_t *b, uint32_t *value);
+int	 bag_iter_batch(bag_t *b, uint32_t *values, int n);
+int	 bag_cycle_batch(bag_t *b, uint32_t *values, int n);
 int	 bag_loop(bag_t *b, bag_handler callback, void *arg);
 
 int	 bag_refill(bag_t *b);
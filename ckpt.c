@@ -0,0 +1,188 @@
+/*
+ * ckpt.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <dnet.h>
+#include <pcap.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bag.h"
+#include "ckpt.h"
+#include "dedup.h"
+#include "dscan.h"
+#include "excl.h"
+#include "osstack.h"
+#include "perm.h"
+#include "rxring.h"
+#include "xsk.h"
+#include "dscan-int.h"
+#include "hash.h"
+
+/*
+ * A checkpoint is a few lines of text: the scan key and the definition
+ * of the walk it keys (which must match ours to resume it), the bytes
+ * sent so far, how far we got through any input, and the walk position
+ * per interface below which everything has been sent.
+ */
+
+static int
+_ckpt_match(const char *def, const char *val)
+{
+	return (strcmp(def != NULL ? def : "", val) == 0 ? 0 : -1);
+}
+
+/* The key's saved in hex, which had better be all of it. */
+static int
+_ckpt_key(struct dscan_ctx *ctx, const char *val)
+{
+	if (strlen(val) != 32 || strspn(val, "0123456789abcdefABCDEF") != 32)
+		return (-1);
+	
+	return (dscan_set_key(ctx, val));
+}
+
+/* Exclusions may come from a file, so we just note a hash of them. */
+static void
+_ckpt_excl(struct dscan_ctx *ctx, char *buf, size_t size)
+{
+	const uint32_t *start, *end;
+	uint32_t cnt = 0, hash;
+	
+	hash_init(&hash);
+	
+	if (ctx->excl != NULL &&
+	    excl_ranges(ctx->excl, &start, &end, &cnt) == 0) {
+		hash_update(&hash, start, cnt * sizeof(*start));
+		hash_update(&hash, end, cnt * sizeof(*end));
+	}
+	snprintf(buf, size, "%u %08x", cnt, hash);
+}
+
+int
+ckpt_load(struct dscan_ctx *ctx, const char *file)
+{
+	struct dscan_dif *dif;
+	FILE *fp;
+	char buf[BUFSIZ], excl[32], *p, *val;
+	unsigned long long n;
+	long long off;
+	int ret = 0;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		return (-1);
+	
+	_ckpt_excl(ctx, excl, sizeof(excl));
+	
+	while (ret == 0 && fgets(buf, sizeof(buf), fp) != NULL) {
+		if (buf[0] == '#' || (p = strtok(buf, "\r\n")) == NULL)
+			continue;
+		val = strsep(&p, " ");
+		
+		if (p == NULL) {
+			ret = -1;
+		} else if (strcmp(val, "key") == 0) {
+			ret = _ckpt_key(ctx, p);
+		} else if (strcmp(val, "random") == 0) {
+			ret = atoi(p) == ctx->random ? 0 : -1;
+		} else if (strcmp(val, "shard") == 0) {
+			ret = dscan_set_shard(ctx, p);
+		} else if (strcmp(val, "dsts") == 0) {
+			ret = _ckpt_match(ctx->dstlist, p);
+		} else if (strcmp(val, "ports") == 0) {
+			ret = _ckpt_match(ctx->portlist, p);
+		} else if (strcmp(val, "srcs") == 0) {
+			ret = _ckpt_match(ctx->srclist, p);
+		} else if (strcmp(val, "excl") == 0) {
+			ret = _ckpt_match(excl, p);
+		} else if (strcmp(val, "sent") == 0) {
+			ret = sscanf(p, "%llu", &n) == 1 ? 0 : -1;
+			ctx->resume.sent = n;
+		} else if (strcmp(val, "input") == 0) {
+			ret = sscanf(p, "%lld %u", &off,
+			    &ctx->resume.line) == 2 ? 0 : -1;
+			ctx->resume.offset = off;
+		} else if (strcmp(val, "dif") == 0) {
+			val = strsep(&p, " ");
+			TAILQ_FOREACH(dif, &ctx->difs, next) {
+				if (strcmp(dif->ifent.intf_name, val) == 0)
+					break;
+			}
+			if (dif == NULL || p == NULL ||
+			    sscanf(p, "%llu", &n) != 1) {
+				ret = -1;
+			} else
+				dif->pos = n;
+		} else
+			ret = -1;
+	}
+	fclose(fp);
+	
+	if (ret < 0)
+		errno = EINVAL;
+	
+	return (ret);
+}
+
+/* Replace the checkpoint file atomically, so a kill leaves one intact. */
+int
+ckpt_save(struct dscan_ctx *ctx, const char *file, const struct ckpt *ck,
+    const uint64_t *pos)
+{
+	struct dscan_dif *dif;
+	FILE *fp;
+	char tmp[1024], excl[32];
+	int i = 0;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return (-1);
+	
+	fprintf(fp, "# dscan checkpoint\n");
+	fprintf(fp, "key %s\n", dscan_get_key(ctx));
+	fprintf(fp, "random %d\n", ctx->random);
+	fprintf(fp, "shard %d/%d\n", ctx->shard + 1, ctx->shards);
+	fprintf(fp, "dsts %s\n", ctx->dstlist != NULL ? ctx->dstlist : "");
+	fprintf(fp, "ports %s\n", ctx->portlist != NULL ? ctx->portlist : "");
+	fprintf(fp, "srcs %s\n", ctx->srclist != NULL ? ctx->srclist : "");
+	_ckpt_excl(ctx, excl, sizeof(excl));
+	fprintf(fp, "excl %s\n", excl);
+	fprintf(fp, "sent %llu\n", (unsigned long long)ck->sent);
+	fprintf(fp, "input %lld %u\n", (long long)ck->offset, ck->line);
+	
+	TAILQ_FOREACH(dif, &ctx->difs, next) {
+		fprintf(fp, "dif %s %llu\n", dif->ifent.intf_name,
+		    (unsigned long long)pos[i++]);
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+		fclose(fp);
+		unlink(tmp);
+		return (-1);
+	}
+	if (fclose(fp) != 0 || rename(tmp, file) < 0) {
+		unlink(tmp);
+		return (-1);
+	}
+	return (0);
+}
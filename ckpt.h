@@ -0,0 +1,24 @@
+/*
+ * ckpt.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef CKPT_H
+#define CKPT_H
+
+struct dscan_ctx;
+
+struct ckpt {
+	uint64_t	 sent;		/* bytes sent */
+	off_t		 offset;	/* input bytes consumed */
+	uint32_t	 line;		/* input lines consumed */
+};
+
+int	ckpt_load(struct dscan_ctx *ctx, const char *file);
+int	ckpt_save(struct dscan_ctx *ctx, const char *file,
+	    const struct ckpt *ck, const uint64_t *pos);
+
+#endif /* CKPT_H */
@@ -0,0 +1,192 @@
+/*
+ * dedup.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+
+#include <dnet.h>
+
+#include "dedup.h"
+
+#define DEDUP_PAGES	65536		/* one bitmap page per /16 */
+#define DEDUP_SLICE	(1 << 20)	/* first filter slice capacity */
+#define DEDUP_SLICES	24		/* ... and the most we'll grow to */
+
+/*
+ * Addresses seen so far, to drop duplicate targets. With a false
+ * positive rate of 0 we keep an exact bitmap, a page per /16 touched:
+ * 8k per /16, cheap for dense space, up to 512M for targets all over it.
+ * Otherwise we keep a scalable bloom filter: a series of slices, each
+ * twice the size of the last with half its false positive rate, so we
+ * needn't know how many targets there'll be, and the rate over all of
+ * them stays under the one asked for.
+ */
+struct dedup_slice {
+	uint64_t	*bits;
+	uint64_t	 nbits;
+	int		 k;		/* bits set per address */
+	uint64_t	 cap;		/* addresses before we're full */
+	uint64_t	 cnt;
+};
+
+struct dedup {
+	uint64_t	**pages;
+	struct dedup_slice slices[DEDUP_SLICES];
+	int		 nslices;
+	int		 k;		/* bits per address in the first slice */
+	uint64_t	 dups;
+};
+
+#define bit_test(b, i)	((b)[(i) >> 6] & (1ULL << ((i) & 63)))
+#define bit_set(b, i)	((b)[(i) >> 6] |= (1ULL << ((i) & 63)))
+
+static uint64_t
+_dedup_mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31));
+}
+
+static int
+_dedup_grow(dedup_t *d)
+{
+	struct dedup_slice *s;
+	int i = d->nslices;
+
+	if (i == DEDUP_SLICES)
+		return (-1);
+
+	s = &d->slices[i];
+	s->cap = (uint64_t)DEDUP_SLICE << i;
+	s->k = d->k + i;
+	/* m = n * k / ln 2 gives the rate 2^-k. */
+	s->nbits = ((uint64_t)(s->cap * s->k * 1.4427) + 63) & ~63ULL;
+	s->cnt = 0;
+
+	if ((s->bits = calloc(s->nbits / 64, sizeof(uint64_t))) == NULL)
+		return (-1);
+
+	d->nslices++;
+	return (0);
+}
+
+dedup_t *
+dedup_open(double fprate)
+{
+	dedup_t *d;
+	double p;
+
+	if (fprate < 0.0 || fprate >= 1.0)
+		return (NULL);
+
+	if ((d = calloc(1, sizeof(*d))) == NULL)
+		return (NULL);
+
+	if (fprate == 0.0) {
+		if ((d->pages = calloc(DEDUP_PAGES, sizeof(d->pages[0]))) ==
+		    NULL)
+			return (dedup_close(d));
+	} else {
+		/* Half our rate for the first slice, a quarter the next... */
+		for (p = 1.0, d->k = 1; p > fprate; d->k++)
+			p /= 2.0;
+		
+		if (_dedup_grow(d) < 0)
+			return (dedup_close(d));
+	}
+	return (d);
+}
+
+/*
+ * Add an address. Returns 1 if we've (probably) seen it before, 0 if
+ * it's new, or -1 if we couldn't remember it.
+ */
+int
+dedup_add(dedup_t *d, uint32_t addr)
+{
+	struct dedup_slice *s;
+	uint64_t h1, h2, bit;
+	uint64_t *page;
+	int i, j, hit;
+
+	if (d->pages != NULL) {
+		if ((page = d->pages[addr >> 16]) == NULL) {
+			if ((page = calloc(65536 / 64, sizeof(*page))) == NULL)
+				return (-1);
+			d->pages[addr >> 16] = page;
+		}
+		if (bit_test(page, addr & 0xffff)) {
+			d->dups++;
+			return (1);
+		}
+		bit_set(page, addr & 0xffff);
+		return (0);
+	}
+	h1 = _dedup_mix(addr);
+	h2 = _dedup_mix(h1) | 1;
+
+	for (i = 0; i < d->nslices; i++) {
+		s = &d->slices[i];
+		
+		for (j = 0, hit = 1; j < s->k && hit; j++) {
+			bit = (h1 + j * h2) % s->nbits;
+			hit = bit_test(s->bits, bit) != 0;
+		}
+		if (hit) {
+			d->dups++;
+			return (1);
+		}
+	}
+	s = &d->slices[d->nslices - 1];
+	
+	if (s->cnt == s->cap) {
+		if (_dedup_grow(d) < 0)
+			return (-1);
+		s = &d->slices[d->nslices - 1];
+	}
+	for (j = 0; j < s->k; j++) {
+		bit = (h1 + j * h2) % s->nbits;
+		bit_set(s->bits, bit);
+	}
+	s->cnt++;
+	
+	return (0);
+}
+
+/* Return the count of duplicates dropped. */
+uint64_t
+dedup_count(dedup_t *d)
+{
+	return (d->dups);
+}
+
+dedup_t *
+dedup_close(dedup_t *d)
+{
+	int i;
+
+	if (d->pages != NULL) {
+		for (i = 0; i < DEDUP_PAGES; i++) {
+			if (d->pages[i] != NULL)
+				free(d->pages[i]);
+		}
+		free(d->pages);
+	}
+	for (i = 0; i < d->nslices; i++)
+		free(d->slices[i].bits);
+	free(d);
+
+	return (NULL);
+}
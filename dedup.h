@@ -0,0 +1,19 @@
+/*
+ * dedup.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+typedef struct dedup dedup_t;
+
+dedup_t	*dedup_open(double fprate);
+int	 dedup_add(dedup_t *d, uint32_t addr);
+uint64_t dedup_count(dedup_t *d);
+dedup_t	*dedup_close(dedup_t *d);
+
+#endif /* DEDUP_H */
@@ -12,7 +12,11 @@
 struct dscan_dif {
 	struct intf_entry	 ifent;		/* interface info */
 	bag_t			*dsts;		/* dsts routed thru intf */
+	perm_t			*perm;		/* random scan order */
+	uint64_t		 pos;		/* walk position to resume at */
 	pcap_t			*pcap;		/* packet capture handle */
+	rxring_t		*rxring;	/* ... or our own RX ring */
+	xsk_t			*xsk;		/* AF_XDP socket, for xdp */
 	struct event		 ev;		/* receive event */
 	struct dscan_ctx	*ctx;		/* XXX 1 event/pcap cb arg */
 	TAILQ_ENTRY(dscan_dif)	 next;
@@ -23,7 +27,9 @@ struct dscan_ctx {
 	uint32_t		 mode;		/* scan mode */
 	intf_t			*intf;		/* interface handle */
 	rand_t			*rnd;		/* entropy handle */
-	uint32_t		 key;		/* scan key */
+	uint32_t		 key;		/* walk order key */
+	uint64_t		 ckey[2];	/* probe cookie key */
+	char			 keystr[33];	/* ckey, in hex */
 	int			 resolv;	/* resolve IPs to hostnames */
 	int			 spipe[2];	/* self-pipe */
 	TAILQ_HEAD(, dscan_dif)	 difs;		/* listening interfaces */
@@ -33,15 +39,30 @@ struct dscan_ctx {
 
 	/* Scan config */
 	FILE			*input;		/* input handle */
+	uint32_t		 window;	/* input targets to shuffle */
+	int			 echo;		/* echo input targets */
+	dedup_t			*dedup;		/* input targets seen */
 	bag_t			*srcs;		/* sources to spoof */
+	excl_t			*excl;		/* targets never to probe */
 	uint8_t			 proto;		/* scan protocol */
 	bag_t			*ports;		/* target ports / ICMP types */
 	uint8_t			 tcpflags;	/* TCP flags */
 	osstack_t		*osstack;	/* OS personality */
 	int			 random;	/* randomize scan order */
 	float			 bitrate;	/* target bitrate */
-	uint32_t		 tick_usec;	/* tick interval (usec) */
-	uint32_t		 tick_bytes;	/* max bytes per tick */
+	uint32_t		 burst;		/* max bytes back to back */
+	int			 pacing;	/* pacing mode */
+	int			 batch;		/* probes per send batch */
+	int			 sndbuf;	/* send buffer size */
+	int			 engine;	/* transmit engine */
+	int			 threads;	/* sender threads */
+	int			 shard;		/* our slice of the scan */
+	int			 shards;	/* scanners sharing the key */
+	char			*dstlist;	/* target list, as given */
+	char			*portlist;	/* port list, as given */
+	char			*srclist;	/* source list, as given */
+	char			*ckpt;		/* checkpoint file */
+	struct ckpt		 resume;	/* progress to resume from */
 	
 	/* Recv config */
 	struct timeval		 tv;		/* response timeout */
@@ -20,6 +20,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,11 +28,19 @@
 #include <unistd.h>
 
 #include "bag.h"
+#include "ckpt.h"
+#include "dedup.h"
 #include "dscan.h"
+#include "excl.h"
 #include "osstack.h"
+#include "pace.h"
+#include "perm.h"
+#include "rxring.h"
+#include "xsk.h"
 #include "dscan-int.h"
 #include "hash.h"
 #include "parse.h"
+#include "xmit.h"
 
 struct dscan_ctx *
 dscan_open(void)
@@ -43,8 +52,17 @@ dscan_open(void)
 			return (dscan_close(ctx));
 		if ((ctx->rnd = rand_open()) == NULL)
 			return (dscan_close(ctx));
-		ctx->key = rand_uint32(ctx->rnd);
+		if (rand_get(ctx->rnd, ctx->ckey, sizeof(ctx->ckey)) < 0)
+			return (dscan_close(ctx));
+		ctx->key = (uint32_t)hash_cookie(ctx->ckey, 0, 0, 0, 0);
+		hash_cookie_kernel(NULL);
 		ctx->resolv = 1;
+		ctx->batch = 1;
+		ctx->threads = 1;
+		ctx->shards = 1;
+		ctx->window = DSCAN_WINDOW;
+		ctx->sndbuf = DSCAN_SNDBUF;
+		ctx->echo = 1;
 		pipe(ctx->spipe);
 		TAILQ_INIT(&ctx->difs);
 	}
@@ -68,16 +86,6 @@ dscan_set_mode(struct dscan_ctx *ctx, uint32_t mode)
 			dscan_set_ports(ctx, "8");
 		}
 		dscan_set_bitrate(ctx, "128k");
-#ifdef HAVE_CLOCK_GETRES
-		{
-		struct timespec tp;
-		clock_getres(CLOCK_REALTIME, &tp);
-		ctx->tick_usec = (tp.tv_sec * 1000000) + (tp.tv_nsec / 1000);
-		}
-#else
-		ctx->tick_usec = 10 * 1000;
-#endif
-		ctx->tick_usec *= 2;
 	} else
 		return (-1);
 	
@@ -96,16 +104,39 @@ dscan_set_cache(struct dscan_ctx *ctx, int cachesz)
 	return (-1);
 }
 
+/*
+ * Take a 128-bit cookie key as 32 hex digits, the way we print and
+ * checkpoint it, or derive one from any other string. The walk order
+ * is keyed by a 32-bit hash of it, which gives nothing of it away.
+ */
 int
 dscan_set_key(struct dscan_ctx *ctx, const char *key)
 {
-	if ((ctx->key = atoi(key)) == 0) {
-		hash_init(&ctx->key);
-		hash_update(&ctx->key, key, strlen(key));
-	}
+	char buf[17];
+
+	if (strlen(key) == 32 && strspn(key, "0123456789abcdefABCDEF") == 32) {
+		strlcpy(buf, key, sizeof(buf));
+		ctx->ckey[0] = strtoull(buf, NULL, 16);
+		ctx->ckey[1] = strtoull(key + 16, NULL, 16);
+	} else
+		hash_cookie_key(ctx->ckey, key, strlen(key));
+	
+	ctx->key = (uint32_t)hash_cookie(ctx->ckey, 0, 0, 0, 0);
+	
 	return (rand_set(ctx->rnd, &ctx->key, sizeof(ctx->key)));
 }
 
+/* Return the cookie key, as dscan_set_key() takes it. */
+const char *
+dscan_get_key(struct dscan_ctx *ctx)
+{
+	snprintf(ctx->keystr, sizeof(ctx->keystr), "%016llx%016llx",
+	    (unsigned long long)ctx->ckey[0],
+	    (unsigned long long)ctx->ckey[1]);
+	
+	return (ctx->keystr);
+}
+
 int
 dscan_set_resolv(struct dscan_ctx *ctx, int use_dns)
 {
@@ -124,6 +155,11 @@ dscan_set_dsts(struct dscan_ctx *ctx, const char *dsts)
 
 	strcpy(hostlist, dsts);
 	
+	if (ctx->dstlist != NULL)
+		free(ctx->dstlist);
+	if ((ctx->dstlist = strdup(dsts)) == NULL)
+		return (-1);
+	
 	for (p = hostlist; (host = strsep(&p, ",")) != NULL; ) {
 		if (parse_host_range(host, &start, &end) < 0)
 			return (-1);
@@ -154,6 +190,68 @@ dscan_set_dsts(struct dscan_ctx *ctx, const char *dsts)
 	return (0);
 }
 
+/*
+ * Map in a target set saved by mkbag(8). Its members must all go out
+ * the same interface as its first: we don't split up a mapped bag.
+ */
+int
+dscan_set_dsts_file(struct dscan_ctx *ctx, const char *file)
+{
+	struct dscan_dif *dif;
+	struct addr addr;
+	uint32_t dst;
+
+	if ((dif = calloc(1, sizeof(*dif))) == NULL)
+		return (-1);
+	
+	if ((dif->dsts = bag_map(file)) == NULL) {
+		free(dif);
+		return (-1);
+	}
+	if (bag_index(dif->dsts, 0, &dst) < 0) {
+		errno = EINVAL;
+		goto fail;
+	}
+	dst = htonl(dst);
+	dif->ifent.intf_len = sizeof(dif->ifent);
+	addr_pack(&addr, ADDR_TYPE_IP, IP_ADDR_BITS, &dst, IP_ADDR_LEN);
+	
+	if (intf_get_dst(ctx->intf, &dif->ifent, &addr) < 0)
+		goto fail;
+	
+	if (ctx->dstlist != NULL)
+		free(ctx->dstlist);
+	if ((ctx->dstlist = strdup(file)) == NULL)
+		goto fail;
+	
+	dif->ctx = ctx;
+	TAILQ_INSERT_TAIL(&ctx->difs, dif, next);
+	
+	return (0);
+ fail:
+	bag_close(dif->dsts);
+	free(dif);
+	return (-1);
+}
+
+int
+dscan_set_excl(struct dscan_ctx *ctx, const char *prefixes)
+{
+	if (ctx->excl == NULL && (ctx->excl = excl_open()) == NULL)
+		return (-1);
+	
+	return (excl_add_list(ctx->excl, prefixes));
+}
+
+int
+dscan_set_excl_file(struct dscan_ctx *ctx, const char *file)
+{
+	if (ctx->excl == NULL && (ctx->excl = excl_open()) == NULL)
+		return (-1);
+	
+	return (excl_load(ctx->excl, file));
+}
+
 int
 dscan_set_input(struct dscan_ctx *ctx, FILE *fp)
 {
@@ -161,11 +259,50 @@ dscan_set_input(struct dscan_ctx *ctx, FILE *fp)
 	return (0);
 }
 
+int
+dscan_set_window(struct dscan_ctx *ctx, int window)
+{
+	if (window < 1)
+		return (-1);
+	
+	ctx->window = window;
+	return (0);
+}
+
+int
+dscan_set_echo(struct dscan_ctx *ctx, int echo)
+{
+	ctx->echo = echo;
+	return (0);
+}
+
+/* Drop duplicate input targets, at most fprate of new ones with them. */
+int
+dscan_set_dedup(struct dscan_ctx *ctx, const char *fprate)
+{
+	char *ep;
+	double dval;
+	
+	errno = 0;
+	dval = strtod(fprate, &ep);
+	
+	if (fprate[0] == '\0' || *ep != '\0' || errno != 0)
+		return (-1);
+	
+	if (ctx->dedup != NULL)
+		ctx->dedup = dedup_close(ctx->dedup);
+	
+	if ((ctx->dedup = dedup_open(dval)) == NULL)
+		return (-1);
+	
+	return (0);
+}
+
 int
 dscan_set_bitrate(struct dscan_ctx *ctx, const char *bitrate)
 {
 	char *ep;
-	float dval, hz;
+	float dval;
 
 	errno = 0;
 	dval = strtod(bitrate, &ep);
@@ -183,12 +320,189 @@ dscan_set_bitrate(struct dscan_ctx *ctx, const char *bitrate)
 		return (-1);
 	
 	ctx->bitrate = (float)dval;
-	hz = (float)1000000 / (float)ctx->tick_usec;
-	ctx->tick_bytes = (uint32_t)((ctx->bitrate / 8) / hz);
 	
 	return (0);
 }
 
+int
+dscan_set_burst(struct dscan_ctx *ctx, const char *burst)
+{
+	char *ep;
+	u_long val, mult = 1;
+
+	errno = 0;
+	val = strtoul(burst, &ep, 10);
+	
+	if (burst[0] == '\0' || errno == ERANGE)
+		return (-1);
+	
+	if (tolower(*ep) == 'k')
+		mult = 1024;
+	else if (tolower(*ep) == 'm')
+		mult = 1024 * 1024;
+	else if (*ep != '\0')
+		return (-1);
+	
+	/* Don't let a large burst wrap around to a small one. */
+	if (val > UINT32_MAX / mult)
+		return (-1);
+	val *= mult;
+	
+	ctx->burst = (uint32_t)val;
+	
+	return (0);
+}
+
+int
+dscan_set_pacing(struct dscan_ctx *ctx, const char *pacing)
+{
+	if (strcmp(pacing, "sleep") == 0)
+		ctx->pacing = PACE_SLEEP;
+	else if (strcmp(pacing, "busy") == 0)
+		ctx->pacing = PACE_BUSY;
+	else if (strcmp(pacing, "txtime") == 0)
+		ctx->pacing = PACE_TXTIME;
+	else if (strcmp(pacing, "etf") == 0)
+		ctx->pacing = PACE_ETF;
+	else
+		return (-1);
+	
+	return (0);
+}
+
+int
+dscan_set_batch(struct dscan_ctx *ctx, int batch)
+{
+	if (batch < 1)
+		return (-1);
+	
+	ctx->batch = batch;
+	return (0);
+}
+
+/* Size each sender's socket buffer, 0 for the system default. */
+int
+dscan_set_sndbuf(struct dscan_ctx *ctx, const char *sndbuf)
+{
+	char *ep;
+	u_long val;
+
+	errno = 0;
+	val = strtoul(sndbuf, &ep, 10);
+	
+	if (sndbuf[0] == '\0' || errno == ERANGE)
+		return (-1);
+	
+	if (tolower(*ep) == 'k')
+		val *= 1024;
+	else if (tolower(*ep) == 'm')
+		val *= (1024 * 1024);
+	else if (*ep != '\0')
+		return (-1);
+	
+	if (val > INT_MAX)
+		return (-1);
+	
+	ctx->sndbuf = (int)val;
+	
+	return (0);
+}
+
+int
+dscan_set_threads(struct dscan_ctx *ctx, int threads)
+{
+	if (threads < 1)
+		return (-1);
+	
+	ctx->threads = threads;
+	
+	return (0);
+}
+
+/* Take shard i of n (counting from 1). */
+int
+dscan_set_shard(struct dscan_ctx *ctx, const char *shard)
+{
+	char *p;
+	long i, n;
+	
+	i = strtol(shard, &p, 10);
+	if (p == shard || *p++ != '/')
+		return (-1);
+	n = strtol(p, &p, 10);
+	
+	if (*p != '\0' || n < 1 || i < 1 || i > n || n > 65536)
+		return (-1);
+	
+	ctx->shard = i - 1;
+	ctx->shards = n;
+	
+	return (0);
+}
+
+/* Checkpoint to file, resuming from it first if it exists. */
+int
+dscan_set_resume(struct dscan_ctx *ctx, const char *file)
+{
+	if ((ctx->ckpt = strdup(file)) == NULL)
+		return (-1);
+	
+	if (ckpt_load(ctx, file) < 0 && errno != ENOENT)
+		return (-1);
+	
+	return (0);
+}
+
+int
+dscan_set_engine(struct dscan_ctx *ctx, const char *engine)
+{
+	int flags = ctx->engine & ~0xff;
+	
+	if (strcmp(engine, "ip") == 0)
+		ctx->engine = XMIT_IP | flags;
+	else if (strcmp(engine, "ring") == 0)
+		ctx->engine = XMIT_RING | flags;
+	else if (strcmp(engine, "xdp") == 0)
+		ctx->engine = XMIT_XDP | flags;
+	else
+		return (-1);
+	
+	return (0);
+}
+
+/*
+ * Open what the engine shares between the scan and recv processes,
+ * before they fork: an AF_XDP socket per interface.
+ */
+int
+dscan_open_engine(struct dscan_ctx *ctx)
+{
+	struct dscan_dif *dif;
+	uint32_t addr;
+
+	if (XMIT_ENGINE(ctx->engine) != XMIT_XDP)
+		return (0);
+
+	/* Replies to spoofed sources could come to any of them. */
+	TAILQ_FOREACH(dif, &ctx->difs, next) {
+		addr = ctx->srcs != NULL ? 0 : dif->ifent.intf_addr.addr_ip;
+		if ((dif->xsk = xsk_open(dif->ifent.intf_name, 0,
+		    addr)) == NULL)
+			return (-1);
+	}
+	return (0);
+}
+
+int
+dscan_set_bypass(struct dscan_ctx *ctx, int bypass)
+{
+	if (bypass)
+		ctx->engine |= XMIT_BYPASS;
+	else
+		ctx->engine &= ~XMIT_BYPASS;
+	return (0);
+}
+
 int
 dscan_set_osstack(struct dscan_ctx *ctx, const char *os)
 {
@@ -214,6 +528,11 @@ dscan_set_srcs(struct dscan_ctx *ctx, const char *srcs)
 	strcpy(hostlist, srcs);
 	ctx->srcs = bag_open();
 	
+	if (ctx->srclist != NULL)
+		free(ctx->srclist);
+	if ((ctx->srclist = strdup(srcs)) == NULL)
+		return (-1);
+	
 	for (p = hostlist; (host = strsep(&p, ",")) != NULL && ret == 0; ) {
 		if ((ret = parse_host_range(host, &start, &end)) == 0)
 			ret = bag_add_range(ctx->srcs,
@@ -259,6 +578,11 @@ dscan_set_ports(struct dscan_ctx *ctx, const char *ports)
 		bag_close(ctx->ports);
 	ctx->ports = bag_open();
 	
+	if (ctx->portlist != NULL)
+		free(ctx->portlist);
+	if ((ctx->portlist = strdup(ports)) == NULL)
+		return (-1);
+	
 	for (p = portlist; (port = strsep(&p, ",")) != NULL && ret == 0; ) {
 		if ((ret = parse_port_range(port, &start, &end)) == 0)
 			ret = bag_add_range(ctx->ports, start, end);
@@ -280,6 +604,7 @@ dscan_close(struct dscan_ctx *ctx)
 		close(ctx->spipe[1]);
 	
 	ctx->key = 0;
+	memset(ctx->ckey, 0, sizeof(ctx->ckey));
 	if (ctx->rnd != NULL)
 		ctx->rnd = rand_close(ctx->rnd);
 	if (ctx->intf != NULL)
@@ -288,6 +613,8 @@ dscan_close(struct dscan_ctx *ctx)
 	for (dif = TAILQ_FIRST(&ctx->difs); dif != NULL; dif = next) {
 		next = TAILQ_NEXT(dif, next);
 		bag_close(dif->dsts);
+		if (dif->xsk != NULL)
+			xsk_close(dif->xsk);
 		free(dif);
 	}
 	if (ctx->hcache != NULL)
@@ -296,6 +623,18 @@ dscan_close(struct dscan_ctx *ctx)
 		ctx->ports = bag_close(ctx->ports);
 	if (ctx->srcs != NULL)
 		ctx->srcs = bag_close(ctx->srcs);
+	if (ctx->excl != NULL)
+		ctx->excl = excl_close(ctx->excl);
+	if (ctx->dedup != NULL)
+		ctx->dedup = dedup_close(ctx->dedup);
+	if (ctx->dstlist != NULL)
+		free(ctx->dstlist);
+	if (ctx->portlist != NULL)
+		free(ctx->portlist);
+	if (ctx->srclist != NULL)
+		free(ctx->srclist);
+	if (ctx->ckpt != NULL)
+		free(ctx->ckpt);
 	
 	free(ctx);
 	
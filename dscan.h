@@ -14,6 +14,8 @@
 #define DSCAN_PING	(1 << 2)
 
 #define DSCAN_RECV_TIMEOUT	3
+#define DSCAN_WINDOW		(1 << 20)	/* input targets to shuffle */
+#define DSCAN_SNDBUF		(4 << 20)	/* send buffer size */
 
 typedef struct dscan_ctx dscan_t;
 
@@ -22,18 +24,35 @@ dscan_t	*dscan_open(void);
 int	 dscan_set_mode(dscan_t *ctx, uint32_t mode);
 
 int	 dscan_set_key(dscan_t *ctx, const char *key);
+const char *dscan_get_key(dscan_t *ctx);
 int	 dscan_set_resolv(dscan_t *ctx, int use_dns);
+int	 dscan_set_dsts_file(dscan_t *ctx, const char *file);
 int	 dscan_set_dsts(dscan_t *ctx, const char *dsts);
 int	 dscan_set_cache(dscan_t *ctx, int cachesz);
+int	 dscan_set_excl(dscan_t *ctx, const char *prefixes);
+int	 dscan_set_excl_file(dscan_t *ctx, const char *file);
 
 int	 dscan_set_input(dscan_t *ctx, FILE *fp);
+int	 dscan_set_window(dscan_t *ctx, int window);
+int	 dscan_set_echo(dscan_t *ctx, int echo);
+int	 dscan_set_dedup(dscan_t *ctx, const char *fprate);
 int	 dscan_set_bitrate(dscan_t *ctx, const char *bitrate);
+int	 dscan_set_burst(dscan_t *ctx, const char *burst);
+int	 dscan_set_pacing(dscan_t *ctx, const char *pacing);
+int	 dscan_set_batch(dscan_t *ctx, int batch);
+int	 dscan_set_sndbuf(dscan_t *ctx, const char *sndbuf);
+int	 dscan_set_threads(dscan_t *ctx, int threads);
+int	 dscan_set_shard(dscan_t *ctx, const char *shard);
+int	 dscan_set_resume(dscan_t *ctx, const char *file);
+int	 dscan_set_engine(dscan_t *ctx, const char *engine);
+int	 dscan_set_bypass(dscan_t *ctx, int bypass);
 int	 dscan_set_osstack(dscan_t *ctx, const char *os);
 int	 dscan_set_random(dscan_t *ctx, int use_rand);
 int	 dscan_set_srcs(dscan_t *ctx, const char *srcs);
 int	 dscan_set_tcpflags(dscan_t *ctx, const char *tcpflags);
 int	 dscan_set_ports(dscan_t *ctx, const char *ports);
 
+int	 dscan_open_engine(dscan_t *ctx);
 void	 dscan_scan(dscan_t *ctx);
 void	 dscan_recv(dscan_t *ctx);
 
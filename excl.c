@@ -0,0 +1,245 @@
+/*
+ * excl.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dnet.h>
+
+#include "excl.h"
+#include "parse.h"
+
+/*
+ * Excluded addresses, as sorted, disjoint ranges (in host byte order)
+ * kept in parallel arrays. Ranges are merged lazily, the first time
+ * we're asked about them after an add. An index by /16 narrows each
+ * lookup to the few ranges there, so its cost stays flat however many
+ * ranges we have.
+ */
+#define EXCL_BUCKETS	65536
+
+struct excl {
+	uint32_t		*start;
+	uint32_t		*end;
+	uint32_t		 cnt;
+	uint32_t		 max;
+	uint32_t		*idx;		/* first range reaching /16 */
+	int			 sorted;
+};
+
+excl_t *
+excl_open(void)
+{
+	return (calloc(1, sizeof(struct excl)));
+}
+
+int
+excl_add(excl_t *e, uint32_t start, uint32_t end)
+{
+	uint32_t *p;
+	
+	if (start > end) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (e->cnt == e->max) {
+		e->max = e->max ? e->max << 1 : 1024;
+		if ((p = realloc(e->start, e->max * sizeof(*p))) == NULL)
+			return (-1);
+		e->start = p;
+		if ((p = realloc(e->end, e->max * sizeof(*p))) == NULL)
+			return (-1);
+		e->end = p;
+	}
+	e->start[e->cnt] = start;
+	e->end[e->cnt] = end;
+	e->cnt++;
+	e->sorted = 0;
+	
+	return (0);
+}
+
+/* Exclude a host, range or whole prefix (network and broadcast too). */
+static int
+_excl_add_host(excl_t *e, const char *host)
+{
+	struct addr addr, bcast;
+	uint32_t start, end;
+	
+	if (addr_aton(host, &addr) == 0 && addr.addr_type == ADDR_TYPE_IP) {
+		addr_net(&addr, &addr);
+		addr_bcast(&addr, &bcast);
+		start = addr.addr_ip;
+		end = bcast.addr_ip;
+	} else if (parse_host_range(host, &start, &end) == 0) {
+		if (strchr(host, '/') != NULL) {
+			start = htonl(ntohl(start) - 1);
+			end = htonl(ntohl(end) + 1);
+		}
+	} else {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (excl_add(e, ntohl(start), ntohl(end)));
+}
+
+int
+excl_add_list(excl_t *e, const char *prefixes)
+{
+	char *p, *host, list[strlen(prefixes) + 1];
+	
+	strcpy(list, prefixes);
+	
+	for (p = list; (host = strsep(&p, ",")) != NULL; ) {
+		if (_excl_add_host(e, host) < 0)
+			return (-1);
+	}
+	return (0);
+}
+
+/* Load a file of hosts, ranges or prefixes, one per line. */
+int
+excl_load(excl_t *e, const char *file)
+{
+	FILE *fp;
+	char buf[BUFSIZ], *p;
+	int ret = 0;
+	
+	if ((fp = fopen(file, "r")) == NULL)
+		return (-1);
+	
+	while (ret == 0 && fgets(buf, sizeof(buf), fp) != NULL) {
+		for (p = buf; isspace((int)*p); p++)
+			;
+		if (*p == '#' || *p == '\0')
+			continue;
+		strtok(p, " \t\r\n#");
+		
+		if ((ret = _excl_add_host(e, p)) < 0)
+			warnx("%s: invalid exclusion %s", file, p);
+	}
+	fclose(fp);
+	
+	return (ret);
+}
+
+static int
+_excl_cmp(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	
+	return (x < y ? -1 : x > y);
+}
+
+/* Sort and merge overlapping or adjacent ranges. */
+static int
+_excl_sort(excl_t *e)
+{
+	uint64_t *v;
+	uint32_t i, j;
+	
+	if (e->sorted)
+		return (0);
+	
+	if (e->idx == NULL &&
+	    (e->idx = malloc((EXCL_BUCKETS + 1) * sizeof(*e->idx))) == NULL)
+		return (-1);
+	if ((v = malloc((e->cnt + 1) * sizeof(*v))) == NULL)
+		return (-1);
+	
+	for (i = 0; i < e->cnt; i++)
+		v[i] = ((uint64_t)e->start[i] << 32) | e->end[i];
+	
+	qsort(v, e->cnt, sizeof(*v), _excl_cmp);
+	
+	for (i = j = 0; i < e->cnt; i++) {
+		if (j > 0 && (v[i] >> 32) <= (uint64_t)e->end[j - 1] + 1) {
+			if ((uint32_t)v[i] > e->end[j - 1])
+				e->end[j - 1] = (uint32_t)v[i];
+		} else {
+			e->start[j] = v[i] >> 32;
+			e->end[j] = (uint32_t)v[i];
+			j++;
+		}
+	}
+	free(v);
+	e->cnt = j;
+	
+	for (i = j = 0; i < EXCL_BUCKETS; i++) {
+		while (j < e->cnt && e->end[j] < i << 16)
+			j++;
+		e->idx[i] = j;
+	}
+	e->idx[EXCL_BUCKETS] = e->cnt;
+	e->sorted = 1;
+	
+	return (0);
+}
+
+/* Return 1 if the host order address is excluded, 0 if not, -1 on error. */
+int
+excl_match(excl_t *e, uint32_t addr)
+{
+	uint32_t lo, hi, mid;
+	
+	if (_excl_sort(e) < 0)
+		return (-1);
+	
+	/* The range holding addr may start in an earlier /16. */
+	lo = e->idx[addr >> 16];
+	hi = MIN(e->idx[(addr >> 16) + 1] + 1, e->cnt);
+	
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (e->end[mid] < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < e->cnt && e->start[lo] <= addr);
+}
+
+/* Point at the merged ranges. */
+int
+excl_ranges(excl_t *e, const uint32_t **start, const uint32_t **end,
+    uint32_t *cnt)
+{
+	if (_excl_sort(e) < 0)
+		return (-1);
+	
+	*start = e->start;
+	*end = e->end;
+	*cnt = e->cnt;
+	
+	return (0);
+}
+
+excl_t *
+excl_close(excl_t *e)
+{
+	if (e->start != NULL)
+		free(e->start);
+	if (e->end != NULL)
+		free(e->end);
+	if (e->idx != NULL)
+		free(e->idx);
+	free(e);
+	
+	return (NULL);
+}
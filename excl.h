@@ -0,0 +1,26 @@
+/*
+ * excl.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef EXCL_H
+#define EXCL_H
+
+typedef struct excl excl_t;
+
+excl_t	*excl_open(void);
+
+int	 excl_add(excl_t *e, uint32_t start, uint32_t end);
+int	 excl_add_list(excl_t *e, const char *prefixes);
+int	 excl_load(excl_t *e, const char *file);
+
+int	 excl_match(excl_t *e, uint32_t addr);
+int	 excl_ranges(excl_t *e, const uint32_t **start, const uint32_t **end,
+	    uint32_t *cnt);
+
+excl_t	*excl_close(excl_t *e);
+
+#endif /* EXCL_H */
@@ -0,0 +1,160 @@
+/*
+ * hash-test.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hash.h"
+
+#define NPROBES		(16 * 1024 * 1024)
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: hash-test [count]\n");
+	exit(1);
+}
+
+static double
+elapsed(struct timeval *start)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	timersub(&tv, start, &tv);
+
+	return ((double)tv.tv_sec + (double)tv.tv_usec / 1000000.0);
+}
+
+/* The old probe cookie: FNV-1 over the tuple, a byte at a time. */
+static uint32_t
+fnv_cookie(uint32_t key, uint8_t proto, uint32_t src, uint32_t dst,
+    uint16_t port)
+{
+	uint32_t hash;
+
+	hash_init(&hash);
+	hash_update(&hash, &key, sizeof(key));
+	hash_update(&hash, &proto, 1);
+	hash_update(&hash, &src, 4);
+	hash_update(&hash, &dst, 4);
+	hash_update(&hash, &port, 2);
+
+	return (hash);
+}
+
+static void
+report(const char *name, double secs, uint32_t n, uint32_t sum)
+{
+	printf("%-12s %8.2f ns/cookie %8.2f Mcookies/s (%08x)\n", name,
+	    secs * 1000000000.0 / n, n / secs / 1000000.0, sum);
+}
+
+static void
+fill_batch(struct hash_batch *hb, uint32_t i, int shuffle)
+{
+	uint32_t k;
+	int j;
+
+	/*
+	 * Sweep ports across a /16, as a scan would: all ports of a host
+	 * in a row, or in random order, each probe to another host.
+	 */
+	for (j = 0; j < HASH_BATCH; j++) {
+		k = shuffle ? (i + j) * 0x9e3779b1 : i + j;
+		hb->src[j] = 0x0a000001;
+		hb->dst[j] = 0xc0a80000 | (k >> 16);
+		hb->port[j] = (6 << 16) | (k & 0xffff);
+	}
+	hb->cnt = HASH_BATCH;
+}
+
+static void
+bench_kernel(const char *name, const uint64_t ckey[2], uint32_t n,
+    int shuffle)
+{
+	struct hash_batch hb;
+	struct timeval start;
+	char buf[32];
+	uint32_t i, sum;
+	int j;
+
+	if (hash_cookie_kernel(name) < 0) {
+		printf("%-12s unsupported\n", name);
+		return;
+	}
+	/* Check it against the scalar cookie first, runs and all. */
+	for (i = 0; i < 65536 * 2; i += HASH_BATCH - 3) {
+		fill_batch(&hb, i, shuffle);
+		hash_cookie_batch(ckey, &hb);
+		
+		for (j = 0; j < HASH_BATCH; j++) {
+			if (hb.hash[j] != hash_cookie(ckey, 6, hb.src[j],
+			    hb.dst[j], hb.port[j] & 0xffff))
+				errx(1, "%s: bad cookie for tuple %u",
+				    name, i + j);
+		}
+	}
+	gettimeofday(&start, NULL);
+	for (i = sum = 0; i < n; i += HASH_BATCH) {
+		fill_batch(&hb, i, shuffle);
+		hash_cookie_batch(ckey, &hb);
+		
+		for (j = 0; j < HASH_BATCH; j++)
+			sum += (uint32_t)hb.hash[j];
+	}
+	snprintf(buf, sizeof(buf), "%s%s", name, shuffle ? "/shuf" : "");
+	report(buf, elapsed(&start), i, sum);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timeval start;
+	uint64_t ckey[2];
+	uint32_t i, n, sum, key = 0xdeadbeef;
+
+	if (argc == 1)
+		n = NPROBES;
+	else if (argc == 2 && (n = atoi(argv[1])) > 0)
+		;
+	else
+		usage();
+
+	gettimeofday(&start, NULL);
+	for (i = sum = 0; i < n; i++) {
+		sum += fnv_cookie(key, 6, 0x0a000001, 0xc0a80000 | (i >> 16),
+		    i & 0xffff);
+	}
+	report("fnv", elapsed(&start), n, sum);
+
+	hash_cookie_key(ckey, &key, sizeof(key));
+	gettimeofday(&start, NULL);
+	for (i = sum = 0; i < n; i++) {
+		sum += hash_cookie(ckey, 6, 0x0a000001,
+		    0xc0a80000 | (i >> 16), i & 0xffff);
+	}
+	report("siphash-1-3", elapsed(&start), n, sum);
+
+	/* Batch kernels, a TX batch at a time. */
+	for (i = 0; i < 2; i++) {
+		bench_kernel("scalar", ckey, n, i);
+		bench_kernel("sse4", ckey, n, i);
+		bench_kernel("avx2", ckey, n, i);
+	}
+
+	exit(0);
+}
@@ -10,6 +10,15 @@
 # include "config.h"
 #endif
 
+#include <sys/types.h>
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HASH_X86
+# include <immintrin.h>
+#endif
+
 #include "hash.h"
 
 /* Public domain Fowler/Noll/Vo hash. */
@@ -33,3 +42,429 @@ hash_update(uint32_t *hash, const void *buf, int len)
 		*hash ^= (uint32_t)*p;
 	}
 }
+
+/*
+ * Probe cookies are SipHash-1-3 over the fixed (proto, src, dst, port)
+ * tuple, packed into two 64-bit words instead of fed a byte at a time.
+ */
+
+#define ROTL64(x, b)	(uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0, v1, v2, v3) do {					\
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;			\
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;			\
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+} while (0)
+
+#define SIPC0		0x736f6d6570736575ULL
+#define SIPC1		0x646f72616e646f6dULL
+#define SIPC2		0x6c7967656e657261ULL
+#define SIPC3		0x7465646279746573ULL
+#define SIPLEN		(13ULL << 56)
+
+/* SipHash-1-3 of len bytes at p, under (k0, k1). */
+static uint64_t
+_hash_sip(uint64_t k0, uint64_t k1, const u_char *p, int len)
+{
+	uint64_t v0, v1, v2, v3, m, b;
+	int i;
+
+	v0 = k0 ^ SIPC0;
+	v1 = k1 ^ SIPC1;
+	v2 = k0 ^ SIPC2;
+	v3 = k1 ^ SIPC3;
+	b = (uint64_t)len << 56;
+
+	for ( ; len >= 8; p += 8, len -= 8) {
+		for (m = 0, i = 7; i >= 0; i--)
+			m = (m << 8) | p[i];
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	for (i = len - 1; i >= 0; i--)
+		b |= (uint64_t)p[i] << (8 * i);
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return (v0 ^ v1 ^ v2 ^ v3);
+}
+
+/*
+ * Derive a cookie key from a key string, each half hashed under its
+ * own fixed key, so it's only as guessable as the string.
+ */
+void
+hash_cookie_key(uint64_t key[2], const void *buf, int len)
+{
+	key[0] = _hash_sip(0, 0, buf, len);
+	key[1] = _hash_sip(1, 0, buf, len);
+}
+
+/*
+ * The first block is all of the tuple that doesn't change over a port
+ * sweep of one target, so its state can be kept and finished per port.
+ */
+void
+hash_cookie_prefix(const uint64_t key[2], uint32_t src, uint32_t dst,
+    struct hash_prefix *hp)
+{
+	uint64_t v0, v1, v2, v3, m;
+
+	v0 = key[0] ^ SIPC0;
+	v1 = key[1] ^ SIPC1;
+	v2 = key[0] ^ SIPC2;
+	v3 = key[1] ^ SIPC3;
+
+	m = ((uint64_t)src << 32) | dst;
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	hp->v[0] = v0;
+	hp->v[1] = v1;
+	hp->v[2] = v2;
+	hp->v[3] = v3;
+}
+
+uint64_t
+hash_cookie_finish(const struct hash_prefix *hp, uint8_t proto, uint16_t port)
+{
+	uint64_t v0, v1, v2, v3, m;
+
+	v0 = hp->v[0];
+	v1 = hp->v[1];
+	v2 = hp->v[2];
+	v3 = hp->v[3];
+
+	/* Last block carries the tuple length (13 bytes). */
+	m = SIPLEN | ((uint64_t)proto << 16) | port;
+	v3 ^= m;
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+
+	return (v0 ^ v1 ^ v2 ^ v3);
+}
+
+uint64_t
+hash_cookie(const uint64_t key[2], uint8_t proto, uint32_t src, uint32_t dst,
+    uint16_t port)
+{
+	struct hash_prefix hp;
+
+	hash_cookie_prefix(key, src, dst, &hp);
+
+	return (hash_cookie_finish(&hp, proto, port));
+}
+
+/*
+ * Batch kernels, for a TX batch of probes or a capture block of
+ * replies at a time. The vector kernels run SipHash in 64-bit lanes,
+ * and are picked at runtime from what the CPU supports. Each comes in
+ * two halves: the whole hash, and the finish of a run of tuples sharing
+ * a prefix.
+ */
+
+#define HASH_RUN	4	/* min average run worth a shared prefix */
+
+typedef void (*hash_kernel)(const uint64_t *key, struct hash_batch *hb,
+    int i);
+typedef void (*hash_finish)(const struct hash_prefix *hp,
+    struct hash_batch *hb, int i, int end);
+
+static void
+_hash_cookie_scalar(const uint64_t *key, struct hash_batch *hb, int i)
+{
+	for ( ; i < hb->cnt; i++) {
+		hb->hash[i] = hash_cookie(key, hb->port[i] >> 16,
+		    hb->src[i], hb->dst[i], hb->port[i] & 0xffff);
+	}
+}
+
+static void
+_hash_finish_scalar(const struct hash_prefix *hp, struct hash_batch *hb,
+    int i, int end)
+{
+	for ( ; i < end; i++) {
+		hb->hash[i] = hash_cookie_finish(hp, hb->port[i] >> 16,
+		    hb->port[i] & 0xffff);
+	}
+}
+
+#ifdef HASH_X86
+#define SIPROUNDV(add, xor, rotl, swap, v0, v1, v2, v3) do {		\
+	v0 = add(v0, v1); v1 = rotl(v1, 13); v1 = xor(v1, v0);		\
+	v0 = swap(v0);							\
+	v2 = add(v2, v3); v3 = rotl(v3, 16); v3 = xor(v3, v2);		\
+	v0 = add(v0, v3); v3 = rotl(v3, 21); v3 = xor(v3, v0);		\
+	v2 = add(v2, v1); v1 = rotl(v1, 17); v1 = xor(v1, v2);		\
+	v2 = swap(v2);							\
+} while (0)
+
+#define ROTL128(x, b)	_mm_or_si128(_mm_slli_epi64(x, b),		\
+			    _mm_srli_epi64(x, 64 - (b)))
+#define SWAP128(x)	_mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define SIPROUND128(v0, v1, v2, v3)					\
+	SIPROUNDV(_mm_add_epi64, _mm_xor_si128, ROTL128, SWAP128,	\
+	    v0, v1, v2, v3)
+
+static void __attribute__((target("sse4.1")))
+_hash_cookie_sse4(const uint64_t *key, struct hash_batch *hb, int i)
+{
+	__m128i k0, k1, v0, v1, v2, v3, m;
+
+	k0 = _mm_set1_epi64x(key[0]);
+	k1 = _mm_set1_epi64x(key[1]);
+
+	for ( ; i + 2 <= hb->cnt; i += 2) {
+		v0 = _mm_xor_si128(k0, _mm_set1_epi64x(SIPC0));
+		v1 = _mm_xor_si128(k1, _mm_set1_epi64x(SIPC1));
+		v2 = _mm_xor_si128(k0, _mm_set1_epi64x(SIPC2));
+		v3 = _mm_xor_si128(k1, _mm_set1_epi64x(SIPC3));
+
+		m = _mm_or_si128(_mm_slli_epi64(_mm_cvtepu32_epi64(
+		    _mm_loadl_epi64((__m128i *)&hb->src[i])), 32),
+		    _mm_cvtepu32_epi64(
+		    _mm_loadl_epi64((__m128i *)&hb->dst[i])));
+		v3 = _mm_xor_si128(v3, m);
+		SIPROUND128(v0, v1, v2, v3);
+		v0 = _mm_xor_si128(v0, m);
+
+		m = _mm_or_si128(_mm_set1_epi64x(SIPLEN), _mm_cvtepu32_epi64(
+		    _mm_loadl_epi64((__m128i *)&hb->port[i])));
+		v3 = _mm_xor_si128(v3, m);
+		SIPROUND128(v0, v1, v2, v3);
+		v0 = _mm_xor_si128(v0, m);
+
+		v2 = _mm_xor_si128(v2, _mm_set1_epi64x(0xff));
+		SIPROUND128(v0, v1, v2, v3);
+		SIPROUND128(v0, v1, v2, v3);
+		SIPROUND128(v0, v1, v2, v3);
+
+		_mm_storeu_si128((__m128i *)&hb->hash[i], _mm_xor_si128(
+		    _mm_xor_si128(v0, v1), _mm_xor_si128(v2, v3)));
+	}
+	_hash_cookie_scalar(key, hb, i);
+}
+
+static void __attribute__((target("sse4.1")))
+_hash_finish_sse4(const struct hash_prefix *hp, struct hash_batch *hb,
+    int i, int end)
+{
+	__m128i v0, v1, v2, v3, m;
+
+	for ( ; i + 2 <= end; i += 2) {
+		v0 = _mm_set1_epi64x(hp->v[0]);
+		v1 = _mm_set1_epi64x(hp->v[1]);
+		v2 = _mm_set1_epi64x(hp->v[2]);
+		v3 = _mm_set1_epi64x(hp->v[3]);
+
+		m = _mm_or_si128(_mm_set1_epi64x(SIPLEN), _mm_cvtepu32_epi64(
+		    _mm_loadl_epi64((__m128i *)&hb->port[i])));
+		v3 = _mm_xor_si128(v3, m);
+		SIPROUND128(v0, v1, v2, v3);
+		v0 = _mm_xor_si128(v0, m);
+
+		v2 = _mm_xor_si128(v2, _mm_set1_epi64x(0xff));
+		SIPROUND128(v0, v1, v2, v3);
+		SIPROUND128(v0, v1, v2, v3);
+		SIPROUND128(v0, v1, v2, v3);
+
+		_mm_storeu_si128((__m128i *)&hb->hash[i], _mm_xor_si128(
+		    _mm_xor_si128(v0, v1), _mm_xor_si128(v2, v3)));
+	}
+	_hash_finish_scalar(hp, hb, i, end);
+}
+
+#define ROTL256(x, b)	_mm256_or_si256(_mm256_slli_epi64(x, b),	\
+			    _mm256_srli_epi64(x, 64 - (b)))
+#define SWAP256(x)	_mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define SIPROUND256(v0, v1, v2, v3)					\
+	SIPROUNDV(_mm256_add_epi64, _mm256_xor_si256, ROTL256, SWAP256,	\
+	    v0, v1, v2, v3)
+
+/*
+ * Load the 32-bit words at p, zero-extended, into the lanes in mask.
+ * A tail short of four lanes stays in AVX2, as falling back to the
+ * (legacy SSE) SSE4 kernel with the upper halves dirty costs more than
+ * the vector width buys us.
+ */
+#define LOAD256(p, mask)	\
+	_mm256_cvtepu32_epi64(_mm_maskload_epi32((const int *)(p), mask))
+#define MASK256(n)	\
+	_mm_cmpgt_epi32(_mm_set1_epi32(n), _mm_setr_epi32(0, 1, 2, 3))
+
+static void __attribute__((target("avx2")))
+_hash_cookie_avx2(const uint64_t *key, struct hash_batch *hb, int i)
+{
+	__m256i k0, k1, v0, v1, v2, v3, m;
+	__m128i mask;
+
+	k0 = _mm256_set1_epi64x(key[0]);
+	k1 = _mm256_set1_epi64x(key[1]);
+
+	for ( ; i < hb->cnt; i += 4) {
+		mask = MASK256(hb->cnt - i);
+		
+		v0 = _mm256_xor_si256(k0, _mm256_set1_epi64x(SIPC0));
+		v1 = _mm256_xor_si256(k1, _mm256_set1_epi64x(SIPC1));
+		v2 = _mm256_xor_si256(k0, _mm256_set1_epi64x(SIPC2));
+		v3 = _mm256_xor_si256(k1, _mm256_set1_epi64x(SIPC3));
+
+		m = _mm256_or_si256(_mm256_slli_epi64(
+		    LOAD256(&hb->src[i], mask), 32),
+		    LOAD256(&hb->dst[i], mask));
+		v3 = _mm256_xor_si256(v3, m);
+		SIPROUND256(v0, v1, v2, v3);
+		v0 = _mm256_xor_si256(v0, m);
+
+		m = _mm256_or_si256(_mm256_set1_epi64x(SIPLEN),
+		    LOAD256(&hb->port[i], mask));
+		v3 = _mm256_xor_si256(v3, m);
+		SIPROUND256(v0, v1, v2, v3);
+		v0 = _mm256_xor_si256(v0, m);
+
+		v2 = _mm256_xor_si256(v2, _mm256_set1_epi64x(0xff));
+		SIPROUND256(v0, v1, v2, v3);
+		SIPROUND256(v0, v1, v2, v3);
+		SIPROUND256(v0, v1, v2, v3);
+
+		_mm256_maskstore_epi64((long long *)&hb->hash[i],
+		    _mm256_cvtepi32_epi64(mask), _mm256_xor_si256(
+		    _mm256_xor_si256(v0, v1), _mm256_xor_si256(v2, v3)));
+	}
+	_mm256_zeroupper();
+}
+
+static void __attribute__((target("avx2")))
+_hash_finish_avx2(const struct hash_prefix *hp, struct hash_batch *hb,
+    int i, int end)
+{
+	__m256i v0, v1, v2, v3, m;
+	__m128i mask;
+
+	for ( ; i < end; i += 4) {
+		mask = MASK256(end - i);
+		
+		v0 = _mm256_set1_epi64x(hp->v[0]);
+		v1 = _mm256_set1_epi64x(hp->v[1]);
+		v2 = _mm256_set1_epi64x(hp->v[2]);
+		v3 = _mm256_set1_epi64x(hp->v[3]);
+
+		m = _mm256_or_si256(_mm256_set1_epi64x(SIPLEN),
+		    LOAD256(&hb->port[i], mask));
+		v3 = _mm256_xor_si256(v3, m);
+		SIPROUND256(v0, v1, v2, v3);
+		v0 = _mm256_xor_si256(v0, m);
+
+		v2 = _mm256_xor_si256(v2, _mm256_set1_epi64x(0xff));
+		SIPROUND256(v0, v1, v2, v3);
+		SIPROUND256(v0, v1, v2, v3);
+		SIPROUND256(v0, v1, v2, v3);
+
+		_mm256_maskstore_epi64((long long *)&hb->hash[i],
+		    _mm256_cvtepi32_epi64(mask), _mm256_xor_si256(
+		    _mm256_xor_si256(v0, v1), _mm256_xor_si256(v2, v3)));
+	}
+	_mm256_zeroupper();
+}
+#endif /* HASH_X86 */
+
+/* Set once by hash_cookie_kernel(), before any sender threads start. */
+static hash_kernel	 _hash_kernel = _hash_cookie_scalar;
+static hash_finish	 _hash_finish = _hash_finish_scalar;
+
+/* Select a batch kernel by name, or the widest one we can run (NULL). */
+int
+hash_cookie_kernel(const char *name)
+{
+	hash_kernel k = _hash_cookie_scalar;
+	hash_finish f = _hash_finish_scalar;
+	
+	if (name != NULL && strcmp(name, "scalar") == 0) {
+		;
+#ifdef HASH_X86
+	} else if (name != NULL && strcmp(name, "sse4") == 0) {
+		if (!__builtin_cpu_supports("sse4.1"))
+			return (-1);
+		k = _hash_cookie_sse4;
+		f = _hash_finish_sse4;
+	} else if (name != NULL && strcmp(name, "avx2") == 0) {
+		if (!__builtin_cpu_supports("avx2"))
+			return (-1);
+		k = _hash_cookie_avx2;
+		f = _hash_finish_avx2;
+	} else if (name == NULL) {
+		if (__builtin_cpu_supports("avx2")) {
+			k = _hash_cookie_avx2;
+			f = _hash_finish_avx2;
+		} else if (__builtin_cpu_supports("sse4.1")) {
+			k = _hash_cookie_sse4;
+			f = _hash_finish_sse4;
+		}
+#endif
+	} else if (name != NULL)
+		return (-1);
+	
+	_hash_kernel = k;
+	_hash_finish = f;
+	
+	return (0);
+}
+
+/*
+ * Probes in sweep order come in runs of ports on one (src, dst), whose
+ * prefix we hash once per run. Shuffled probes don't, and get the whole
+ * hash.
+ */
+void
+hash_cookie_batch(const uint64_t key[2], struct hash_batch *hb)
+{
+	struct hash_prefix hp;
+	int i, j, runs;
+	
+	for (i = 1, runs = hb->cnt > 0; i < hb->cnt; i++) {
+		if (hb->src[i] != hb->src[i - 1] ||
+		    hb->dst[i] != hb->dst[i - 1])
+			runs++;
+	}
+	if (runs * HASH_RUN > hb->cnt) {
+		_hash_kernel(key, hb, 0);
+		return;
+	}
+	for (i = 0; i < hb->cnt; i = j) {
+		for (j = i + 1; j < hb->cnt && hb->src[j] == hb->src[i] &&
+		    hb->dst[j] == hb->dst[i]; j++)
+			;
+		hash_cookie_prefix(key, hb->src[i], hb->dst[i], &hp);
+		_hash_finish(&hp, hb, i, j);
+	}
+}
+
+/* Return a mask of the tuples whose cookie checks out. */
+uint32_t
+hash_cookie_verify(const uint64_t key[2], struct hash_batch *hb)
+{
+	uint32_t mask = 0;
+	int i;
+
+	hash_cookie_batch(key, hb);
+
+	for (i = 0; i < hb->cnt; i++) {
+		if ((uint32_t)hb->hash[i] == hb->cookie[i])
+			mask |= 1 << i;
+	}
+	return (mask);
+}
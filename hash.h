@@ -12,4 +12,31 @@
 void	hash_init(uint32_t *h);
 void	hash_update(uint32_t *h, const void *buf, int len);
 
+#define HASH_BATCH	16
+
+struct hash_batch {
+	uint32_t	 src[HASH_BATCH];	/* probe tuples */
+	uint32_t	 dst[HASH_BATCH];
+	uint32_t	 port[HASH_BATCH];	/* proto << 16 | port */
+	uint32_t	 cookie[HASH_BATCH];	/* cookies to verify */
+	uint64_t	 hash[HASH_BATCH];	/* computed cookies */
+	int		 cnt;
+};
+
+struct hash_prefix {
+	uint64_t	 v[4];		/* SipHash state after (src, dst) */
+};
+
+void	 hash_cookie_key(uint64_t key[2], const void *buf, int len);
+uint64_t hash_cookie(const uint64_t key[2], uint8_t proto,
+	    uint32_t src, uint32_t dst, uint16_t port);
+void	 hash_cookie_prefix(const uint64_t key[2], uint32_t src, uint32_t dst,
+	    struct hash_prefix *hp);
+uint64_t hash_cookie_finish(const struct hash_prefix *hp, uint8_t proto,
+	    uint16_t port);
+
+int	 hash_cookie_kernel(const char *name);
+void	 hash_cookie_batch(const uint64_t key[2], struct hash_batch *hb);
+uint32_t hash_cookie_verify(const uint64_t key[2], struct hash_batch *hb);
+
 #endif /* HASH_H */
@@ -0,0 +1,379 @@
+/*
+ * input.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <dnet.h>
+#include <pcap.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bag.h"
+#include "ckpt.h"
+#include "dedup.h"
+#include "dscan.h"
+#include "excl.h"
+#include "input.h"
+#include "osstack.h"
+#include "perm.h"
+#include "rxring.h"
+#include "xsk.h"
+#include "dscan-int.h"
+#include "parse.h"
+
+#define INPUT_NWIN	2		/* one being read, one being sent */
+#define INPUT_BLOCK	65536		/* bytes read at a time */
+#define INPUT_CHUNK	4096		/* targets published at a time */
+#define INPUT_WAIT	100000		/* ns to wait for the other side */
+
+#define input_barrier()	__sync_synchronize()
+
+/*
+ * Targets read from a file or pipe, a window at a time. A reader thread
+ * reads the input in blocks and parses it into one window while the
+ * sender works through the other, so the sender never waits on I/O.
+ * Each side moves only its own end of the window ring, and the reader
+ * publishes its count of targets in the window being read as it goes,
+ * so there's no lock between them: whoever gets ahead polls.
+ *
+ * A range or prefix on an input line may span windows; a window
+ * starting partway through one resumes at its line. Duplicate targets
+ * are dropped here if asked, before they cost a probe per port.
+ */
+struct input {
+	struct dscan_ctx	*ctx;
+	pthread_t		 thread;
+	struct input_win	 win[INPUT_NWIN];
+	volatile u_int		 rd;		/* windows sent */
+	volatile u_int		 wr;		/* windows read */
+	volatile int		 eof;		/* no more to read */
+
+	/* Reader state */
+	struct input_win	*w;		/* window being read */
+	uint32_t		 n;		/* targets in it */
+	off_t			 off;		/* input bytes consumed */
+	uint32_t		 line;		/* input lines consumed */
+};
+
+/*
+ * The reader may only be cancelled while it waits, never while it
+ * holds the stdout lock to echo a line.
+ */
+static void
+_input_sleep(void)
+{
+	struct timespec ts = { 0, INPUT_WAIT };
+	int state;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+	nanosleep(&ts, NULL);
+	pthread_setcancelstate(state, NULL);
+}
+
+static ssize_t
+_input_fill(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+	int state;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+	n = read(fd, buf, len);
+	pthread_setcancelstate(state, NULL);
+
+	return (n);
+}
+
+/* Start reading into the next free window. */
+static void
+_input_take(struct input *in, off_t off, uint32_t line)
+{
+	while (in->wr - in->rd == INPUT_NWIN)
+		_input_sleep();
+	input_barrier();
+
+	in->w = &in->win[in->wr % INPUT_NWIN];
+	in->w->cnt = in->n = 0;
+	in->w->offset = off;
+	in->w->line = line;
+}
+
+/* Let the sender at the targets we've read. */
+static void
+_input_publish(struct input *in)
+{
+	input_barrier();
+	in->w->cnt = in->n;
+}
+
+/* Hand a window we've read to the sender. */
+static void
+_input_push(struct input *in, off_t off, uint32_t line)
+{
+	in->w->next_offset = off;
+	in->w->next_line = line;
+	_input_publish(in);
+	input_barrier();
+	in->wr++;
+}
+
+/* Parse a dotted quad, the common case, without a copy. */
+static int
+_input_aton(const char *p, const char *end, uint32_t *ip)
+{
+	uint32_t val, octet;
+	int i, digits;
+
+	for (i = 0, val = 0; i < 4; i++) {
+		for (octet = digits = 0; p < end && *p >= '0' && *p <= '9' &&
+		    digits < 3; p++, digits++)
+			octet = octet * 10 + (*p - '0');
+
+		if (digits == 0 || octet > 255)
+			return (-1);
+
+		val = (val << 8) | octet;
+
+		if (i < 3 && (p == end || *p++ != '.'))
+			return (-1);
+	}
+	if (p != end)
+		return (-1);
+
+	*ip = val;
+	return (0);
+}
+
+static void
+_input_line(struct input *in, const char *p, size_t len)
+{
+	struct dscan_ctx *ctx = in->ctx;
+	char buf[BUFSIZ];
+	uint32_t start, end, line;
+	uint64_t step;
+	const char *q;
+	off_t off;
+
+	off = in->off;
+	line = in->line;
+	in->off += len;
+
+	if (len == 0 || *p == '#' || *p == ' ' || *p == '\t' || *p == '\r' ||
+	    *p == '\n')
+		return;
+
+	/* Lines are dealt out to shards as walk positions are. */
+	if (perm_slice(in->line++, ctx->shard, ctx->shards, 0, 1,
+	    &step) != line)
+		return;
+
+	if (ctx->echo)
+		fwrite(p, len, 1, stdout);
+
+	for (q = p; q < p + len && *q != ' ' && *q != '\t' && *q != '\r' &&
+	    *q != '\n'; q++)
+		;
+	if (_input_aton(p, q, &start) == 0) {
+		end = start;
+	} else if ((size_t)(q - p) < sizeof(buf)) {
+		/* Ranges, prefixes, whatever else we take on the command line. */
+		memcpy(buf, p, q - p);
+		buf[q - p] = '\0';
+
+		if (parse_host_range(buf, &start, &end) < 0)
+			return;
+		start = ntohl(start);
+		end = ntohl(end);
+	} else
+		return;
+
+	for (;; start++) {
+		if ((ctx->excl == NULL || excl_match(ctx->excl, start) == 0) &&
+		    (ctx->dedup == NULL || dedup_add(ctx->dedup, start) <= 0)) {
+			if (in->n == ctx->window) {
+				_input_push(in, off, line);
+				_input_take(in, off, line);
+			}
+			in->w->dsts[in->n++] = htonl(start);
+
+			if (in->n % INPUT_CHUNK == 0)
+				_input_publish(in);
+		}
+		if (start == end)
+			break;
+	}
+}
+
+static void *
+_input_read(void *arg)
+{
+	struct input *in = (struct input *)arg;
+	struct dscan_ctx *ctx = in->ctx;
+	char *buf, *p, *q;
+	size_t len;
+	ssize_t n;
+	off_t off;
+	int fd;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	fd = fileno(ctx->input);
+	in->off = ctx->resume.offset;
+	in->line = ctx->resume.line;
+	_input_take(in, in->off, in->line);
+
+	if ((buf = malloc(INPUT_BLOCK)) == NULL)
+		goto done;
+
+	/* Skip what we've already scanned, the hard way on a pipe. */
+	if (in->off > 0 && lseek(fd, in->off, SEEK_SET) < 0) {
+		for (off = in->off; off > 0; off -= n) {
+			n = _input_fill(fd, buf, MIN(off, INPUT_BLOCK));
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n <= 0)
+				break;
+		}
+	}
+
+	for (len = 0; ; ) {
+		if ((n = _input_fill(fd, buf + len, INPUT_BLOCK - len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			n = 0;
+		}
+		len += n;
+
+		for (p = buf; (q = memchr(p, '\n', buf + len - p)) != NULL;
+		    p = q + 1)
+			_input_line(in, p, q - p + 1);
+
+		/* At the end, or on a line too long to hold, take it all. */
+		if (n == 0 || (p == buf && len == INPUT_BLOCK)) {
+			_input_line(in, p, buf + len - p);
+			p = buf + len;
+		}
+		len = buf + len - p;
+		memmove(buf, p, len);
+
+		_input_publish(in);
+
+		if (n == 0)
+			break;
+	}
+	free(buf);
+ done:
+	_input_push(in, in->off, in->line);
+	input_barrier();
+	in->eof = 1;
+
+	return (NULL);
+}
+
+input_t *
+input_open(struct dscan_ctx *ctx)
+{
+	struct input *in;
+	int i;
+
+	if ((in = calloc(1, sizeof(*in))) == NULL)
+		return (NULL);
+
+	in->ctx = ctx;
+
+	for (i = 0; i < INPUT_NWIN; i++) {
+		if ((in->win[i].dsts = calloc(ctx->window,
+		    sizeof(in->win[i].dsts[0]))) == NULL)
+			goto fail;
+	}
+	if ((errno = pthread_create(&in->thread, NULL, _input_read,
+	    in)) != 0)
+		goto fail;
+
+	return (in);
+ fail:
+	for (i = 0; i < INPUT_NWIN; i++) {
+		if (in->win[i].dsts != NULL)
+			free(in->win[i].dsts);
+	}
+	free(in);
+	return (NULL);
+}
+
+/*
+ * Return the window to send next, with the count of targets read into
+ * it so far, and whether that's all of them. Returns NULL at the end.
+ */
+struct input_win *
+input_get(input_t *in, uint32_t *cnt, int *done)
+{
+	struct input_win *w;
+	int eof;
+
+	eof = in->eof;
+	input_barrier();
+
+	if (in->rd == in->wr) {
+		if (eof)
+			return (NULL);
+		*done = 0;
+	} else
+		*done = 1;
+
+	w = &in->win[in->rd % INPUT_NWIN];
+	*cnt = w->cnt;
+	input_barrier();
+
+	return (w);
+}
+
+/* Wait a bit for more targets. */
+void
+input_wait(input_t *in)
+{
+	_input_sleep();
+}
+
+/* Give back a window we're done sending, to be read into again. */
+void
+input_put(input_t *in, struct input_win *w)
+{
+	/* Until the reader's back at it, there's nothing in it. */
+	w->cnt = 0;
+	input_barrier();
+	in->rd++;
+}
+
+input_t *
+input_close(input_t *in)
+{
+	int i;
+
+	/* We may be stopping early, with the reader still going. */
+	pthread_cancel(in->thread);
+	pthread_join(in->thread, NULL);
+
+	for (i = 0; i < INPUT_NWIN; i++)
+		free(in->win[i].dsts);
+	free(in);
+
+	return (NULL);
+}
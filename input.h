@@ -0,0 +1,31 @@
+/*
+ * input.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+struct dscan_ctx;
+
+typedef struct input input_t;
+
+struct input_win {
+	uint32_t	*dsts;		/* targets, in network byte order */
+	volatile uint32_t cnt;		/* targets read in so far */
+	off_t		 offset;	/* input bytes consumed before us */
+	uint32_t	 line;		/* input lines consumed before us */
+	off_t		 next_offset;	/* ... and once we're done */
+	uint32_t	 next_line;
+};
+
+input_t	*input_open(struct dscan_ctx *ctx);
+struct input_win *input_get(input_t *in, uint32_t *cnt, int *done);
+void	 input_wait(input_t *in);
+void	 input_put(input_t *in, struct input_win *w);
+input_t	*input_close(input_t *in);
+
+#endif /* INPUT_H */
@@ -43,10 +43,22 @@ usage(void)
 	"      ping        ICMP echo sweep\n"
 	"      recv        listen-only receiver\n"
 	"  Global opts:\n"
-	"      -k key      scan/recv key (any string)\n"
+	"      -k key      scan/recv key (32 hex digits, or any string)\n"
 	"      -n          no hostname lookups\n"
+	"      -e engine   packet engine (one of ip, ring, xdp, default ip)\n"
 	"  Scan opts:\n"
 	"      -b bitrate  scan bitrate (e.g. 1.2m, default 128k)\n"
+	"      -w burst    max bytes sent back to back (default 10ms of bitrate)\n"
+	"      -P pacing   pacing mode (one of sleep, busy, txtime, etf, default sleep)\n"
+	"      -B batch    probes per send batch (default 1)\n"
+	"      -M sndbuf   sender socket buffer size (e.g. 16m, default 4m)\n"
+	"      -T threads  sender threads (default 1)\n"
+	"      -W window   stdin targets to shuffle at a time (default 1048576)\n"
+	"      -q          don't echo targets read from stdin\n"
+	"      -u fprate   drop duplicate stdin targets (0 for exact, e.g. 0.001)\n"
+	"      -S i/n      scan only shard i of n (with the same key everywhere)\n"
+	"      -R file     checkpoint to file, resuming from it if it exists\n"
+	"      -Q          bypass the qdisc layer (ring engine only)\n"
 	"      -o os       OS stack to emulate (one of win9x, win2k, sol, linux, obsd)\n"
 	"      -r          randomize scan order\n"
 	"      -s srcs     decoy/receiver host/prefix list (e.g. decoyhost,recvhost)\n"
@@ -54,6 +66,9 @@ usage(void)
 	"      -f flags    TCP flags (any combination of SAFRPUWE, default S)\n"
 	"      -p ports    TCP port list (e.g. ftp,ssh,smtp,135-139, default 1-65535)\n"
 	"  Target opts:\n"
+	"      -t file     target set saved by mkbag (instead of dst)\n"
+	"      -x file     exclude hosts/prefixes listed in file\n"
+	"      -X excl     exclude host/prefix list (e.g. 10.1/16,10.2.3.4)\n"
 	"      dst         target host/prefix list (e.g. targethost,192.178/16,10/8)\n"
 	);
 	if (pager != NULL)
@@ -66,7 +81,8 @@ main(int argc, char *argv[])
 {
 	dscan_t *dscan;
 	uint32_t mode = 0;
-	int c, status;
+	char *resume = NULL, *tfile = NULL;
+	int c, status, kflag = 0, sflag = 0;
 	pid_t pid;
 
 	if (argc < 2)
@@ -88,11 +104,12 @@ main(int argc, char *argv[])
 	
 	argc--,	argv++;
 	
-	while ((c = getopt(argc, argv, "k:nb:o:rs:f:p:?")) != -1) {
+	while ((c = getopt(argc, argv, "k:nb:w:P:B:M:T:S:R:W:qu:e:Qo:rs:f:p:t:x:X:?")) != -1) {
 		switch (c) {
 		case 'k':
 			if (dscan_set_key(dscan, optarg) < 0)
 				errx(1, "couldn't set key");
+			kflag = 1;
 			break;
 		case 'n':
 			if (dscan_set_resolv(dscan, 0) < 0)
@@ -104,6 +121,75 @@ main(int argc, char *argv[])
 					errx(1, "couldn't set bitrate");
 			} else usage();
 			break;
+		case 'w':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_burst(dscan, optarg) < 0)
+					errx(1, "couldn't set burst size");
+			} else usage();
+			break;
+		case 'P':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_pacing(dscan, optarg) < 0)
+					errx(1, "couldn't set pacing mode");
+			} else usage();
+			break;
+		case 'B':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_batch(dscan, atoi(optarg)) < 0)
+					errx(1, "couldn't set batch size");
+			} else usage();
+			break;
+		case 'M':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_sndbuf(dscan, optarg) < 0)
+					errx(1, "couldn't set send buffer size");
+			} else usage();
+			break;
+		case 'T':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_threads(dscan, atoi(optarg)) < 0)
+					errx(1, "couldn't set sender threads");
+			} else usage();
+			break;
+		case 'W':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_window(dscan, atoi(optarg)) < 0)
+					errx(1, "couldn't set input window");
+			} else usage();
+			break;
+		case 'q':
+			if (mode != DSCAN_RECV)
+				dscan_set_echo(dscan, 0);
+			else usage();
+			break;
+		case 'u':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_dedup(dscan, optarg) < 0)
+					errx(1, "couldn't set dedup rate");
+			} else usage();
+			break;
+		case 'S':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_shard(dscan, optarg) < 0)
+					errx(1, "couldn't set shard");
+				sflag = 1;
+			} else usage();
+			break;
+		case 'R':
+			if (mode != DSCAN_RECV)
+				resume = optarg;
+			else usage();
+			break;
+		case 'e':
+			if (dscan_set_engine(dscan, optarg) < 0)
+				errx(1, "couldn't set packet engine");
+			break;
+		case 'Q':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_bypass(dscan, 1) < 0)
+					errx(1, "couldn't set qdisc bypass");
+			} else usage();
+			break;
 		case 'o':
 			if (mode != DSCAN_RECV) {
 				if (dscan_set_osstack(dscan, optarg) < 0)
@@ -134,6 +220,24 @@ main(int argc, char *argv[])
 					errx(1, "couldn't set ports");
 			} else usage();
 			break;
+		case 't':
+			if (mode != DSCAN_RECV)
+				tfile = optarg;
+			else usage();
+			break;
+		case 'x':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_excl_file(dscan, optarg) < 0)
+					err(1, "couldn't load exclusions from %s",
+					    optarg);
+			} else usage();
+			break;
+		case 'X':
+			if (mode != DSCAN_RECV) {
+				if (dscan_set_excl(dscan, optarg) < 0)
+					errx(1, "couldn't set exclusions");
+			} else usage();
+			break;
 		default:
 			usage();
 			break;
@@ -141,7 +245,15 @@ main(int argc, char *argv[])
 	}
 	argc -= optind, argv += optind;
 	
-	if (argc == 1) {
+	if (sflag && !kflag)
+		errx(1, "sharded scans need a common key (-k)");
+	
+	if (tfile != NULL) {
+		if (argc != 0)
+			usage();
+		if (dscan_set_dsts_file(dscan, tfile) < 0)
+			err(1, "couldn't map targets from %s", tfile);
+	} else if (argc == 1) {
 		dscan_set_dsts(dscan, argv[0]);
 	} else if (argc == 0) {
 		dscan_set_dsts(dscan, "255.255.255.255");
@@ -150,6 +262,13 @@ main(int argc, char *argv[])
 	} else
 		usage();
 
+	/* After the targets, which the checkpoint must match. */
+	if (resume != NULL && dscan_set_resume(dscan, resume) < 0)
+		err(1, "couldn't resume from %s", resume);
+	
+	if (dscan_open_engine(dscan) < 0)
+		err(1, "couldn't open packet engine");
+	
 	if (mode != DSCAN_RECV && (pid = fork()) != 0) {
 		sleep(1);
 		dscan_scan(dscan);
@@ -0,0 +1,86 @@
+/*
+ * mkbag.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dnet.h>
+
+#include "bag.h"
+#include "parse.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: mkbag output [file ...]\n");
+	exit(1);
+}
+
+/* Add each host/net in a list, one per line. */
+static void
+load(bag_t *bag, FILE *fp, const char *name)
+{
+	char *p, buf[BUFSIZ];
+	uint32_t start, end;
+	int line;
+
+	for (line = 1; fgets(buf, sizeof(buf), fp) != NULL; line++) {
+		if ((p = strchr(buf, '#')) != NULL)
+			*p = '\0';
+		p = buf + strspn(buf, " \t");
+		p[strcspn(p, " \t\r\n")] = '\0';
+
+		if (*p == '\0')
+			continue;
+
+		if (parse_host_range(p, &start, &end) < 0)
+			errx(1, "%s:%d: invalid host/net: %s", name, line, p);
+
+		if (bag_add_range(bag, ntohl(start), ntohl(end)) < 0)
+			err(1, "bag_add_range");
+	}
+	if (ferror(fp))
+		err(1, "%s", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bag_t *bag;
+	FILE *fp;
+	int i;
+
+	if (argc < 2 || argv[1][0] == '-')
+		usage();
+
+	bag = bag_open();
+
+	if (argc == 2)
+		load(bag, stdin, "stdin");
+
+	for (i = 2; i < argc; i++) {
+		if ((fp = fopen(argv[i], "r")) == NULL)
+			err(1, "%s", argv[i]);
+		load(bag, fp, argv[i]);
+		fclose(fp);
+	}
+	if (bag_save(bag, argv[1]) < 0)
+		err(1, "couldn't save %s", argv[1]);
+
+	printf("%u targets saved to %s\n", bag_count(bag), argv[1]);
+
+	bag_close(bag);
+
+	exit(0);
+}
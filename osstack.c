@@ -134,6 +134,38 @@ osstack_syn_rewrite(struct osstack *o, void *pkt, int size)
 	return (0);
 }
 
+int
+osstack_syn_count(struct osstack *o)
+{
+	return (o != NULL ? 1 : OSSTACK_SYN_SZ);
+}
+
+int
+osstack_syn_index(struct osstack *o, uint32_t src)
+{
+	return (o != NULL ? 0 : src % OSSTACK_SYN_SZ);
+}
+
+/* Return offset of the TCP timestamp value in a rewritten SYN, or -1. */
+int
+osstack_syn_tsoff(struct osstack *o, uint32_t src)
+{
+	struct osstack_syn *syn;
+	u_char *p;
+	int off = IP_HDR_LEN + TCP_HDR_LEN;
+
+	syn = o != NULL ? o->syn : &osstack_syns[src % OSSTACK_SYN_SZ];
+
+	for (p = syn->th_opt; *p != '\0'; p++) {
+		if (*p == '%') {
+			if (*++p == 'D')
+				return (off);
+		}
+		off++;
+	}
+	return (-1);
+}
+
 struct osstack *
 osstack_close(struct osstack *o)
 {
@@ -13,6 +13,9 @@ typedef struct osstack osstack_t;
 
 osstack_t	*osstack_open(const char *os);
 int		 osstack_syn_rewrite(osstack_t *o, void *pkt, int size);
+int		 osstack_syn_count(osstack_t *o);
+int		 osstack_syn_index(osstack_t *o, uint32_t src);
+int		 osstack_syn_tsoff(osstack_t *o, uint32_t src);
 osstack_t	*osstack_close(osstack_t *o);
 
 #endif /* OSSTACK_H */
@@ -0,0 +1,184 @@
+/*
+ * pace.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pace.h"
+
+#define NSEC		1000000000ULL
+#define PACE_LEAD	200000		/* min ns to stamp ahead of the clock */
+
+/*
+ * Token bucket on the monotonic clock, kept as a theoretical arrival
+ * time (GCRA). Line time is accounted exactly, as a fraction of bps,
+ * so there is no drift however small a probe is against the bitrate.
+ * We may run up to half the bucket ahead of the clock, and bank up to
+ * half of it when we fall behind (e.g. on sleep overshoot).
+ *
+ * In the launch time modes, the kernel holds each probe until its
+ * arrival time, so we run ahead by up to half the bucket and wake to
+ * top it up, never letting the queue run dry. There's no banking then:
+ * a probe stamped in the past would go out at once, or be dropped.
+ */
+struct pace {
+	uint64_t		 bps;		/* bits per second */
+	uint64_t		 tat;		/* theoretical arrival (ns) */
+	uint64_t		 rem;		/* tat remainder (ns * bps) */
+	uint64_t		 slack;		/* half bucket depth (ns) */
+	int			 mode;		/* wait mode */
+	int			 clock;		/* launch time clock */
+	int64_t			 off;		/* ... less the monotonic clock */
+};
+
+static uint64_t
+_pace_clock(int clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return ((uint64_t)ts.tv_sec * NSEC + ts.tv_nsec);
+}
+
+#define _pace_now()	_pace_clock(CLOCK_MONOTONIC)
+
+/* Track the launch clock against ours, in case it's stepped. */
+static void
+_pace_sync(pace_t *p)
+{
+	if (p->clock != CLOCK_MONOTONIC)
+		p->off = (int64_t)(_pace_clock(p->clock) - _pace_now());
+}
+
+pace_t *
+pace_open(float bitrate, uint32_t burst, int mode)
+{
+	struct pace *p;
+
+	if (bitrate < 1.0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if ((p = calloc(1, sizeof(*p))) != NULL) {
+		p->bps = (uint64_t)bitrate;
+		p->mode = mode;
+		p->clock = CLOCK_MONOTONIC;
+#ifdef CLOCK_TAI
+		if (mode == PACE_ETF)
+			p->clock = CLOCK_TAI;
+#endif
+		_pace_sync(p);
+
+		/* Default to 10ms of line time. */
+		if (burst == 0)
+			burst = p->bps / 8 / 100;
+
+		p->slack = (uint64_t)burst * 8 * NSEC / p->bps / 2;
+		p->tat = _pace_now();
+	}
+	return (p);
+}
+
+void
+pace_add(pace_t *p, uint32_t bytes)
+{
+	uint64_t n;
+
+	n = (uint64_t)bytes * 8 * NSEC + p->rem;
+	p->tat += n / p->bps;
+	p->rem = n % p->bps;
+}
+
+int
+pace_ready(pace_t *p)
+{
+	uint64_t now = _pace_now();
+
+	if (PACE_LAUNCH(p->mode))
+		return (p->tat <= now + PACE_LEAD + p->slack * 2);
+
+	if (p->tat + p->slack < now) {
+		p->tat = now - p->slack;
+		p->rem = 0;
+	}
+	return (p->tat <= now + p->slack);
+}
+
+/* Wait for the bucket to drain, or until *stop is set. */
+int
+pace_wait(pace_t *p, volatile uint32_t *stop)
+{
+	struct timespec ts;
+	uint64_t due;
+	int ret;
+
+	/*
+	 * Drain the bucket, so we can send half of it back to back, or
+	 * with launch times, half of what we've queued ahead.
+	 */
+	due = p->tat;
+	if (PACE_LAUNCH(p->mode)) {
+		due -= PACE_LEAD + p->slack;
+		_pace_sync(p);
+	}
+	while (due > _pace_now()) {
+		if (*stop) {
+			errno = EINTR;
+			return (-1);
+		}
+		if (p->mode == PACE_BUSY)
+			continue;
+
+		ts.tv_sec = due / NSEC;
+		ts.tv_nsec = due % NSEC;
+
+		if ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &ts, NULL)) != 0) {
+			errno = ret;
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Return the launch time of the next probe, on the launch clock. If
+ * we've fallen behind (or been idle), start again just ahead of it.
+ */
+uint64_t
+pace_time(pace_t *p)
+{
+	uint64_t now = _pace_now();
+
+	if (p->tat < now + PACE_LEAD) {
+		p->tat = now + PACE_LEAD;
+		p->rem = 0;
+	}
+	return (p->tat + p->off);
+}
+
+int
+pace_clock(pace_t *p)
+{
+	return (p->clock);
+}
+
+pace_t *
+pace_close(pace_t *p)
+{
+	free(p);
+	return (NULL);
+}
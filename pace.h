@@ -0,0 +1,29 @@
+/*
+ * pace.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef PACE_H
+#define PACE_H
+
+#define PACE_SLEEP	0	/* sleep until due */
+#define PACE_BUSY	1	/* busy-poll the clock */
+#define PACE_TXTIME	2	/* stamp departure times for fq */
+#define PACE_ETF	3	/* ... or for etf, on the TAI clock */
+
+#define PACE_LAUNCH(m)	((m) >= PACE_TXTIME)
+
+typedef struct pace pace_t;
+
+pace_t	*pace_open(float bitrate, uint32_t burst, int mode);
+void	 pace_add(pace_t *p, uint32_t bytes);
+int	 pace_ready(pace_t *p);
+int	 pace_wait(pace_t *p, volatile uint32_t *stop);
+uint64_t pace_time(pace_t *p);
+int	 pace_clock(pace_t *p);
+pace_t	*pace_close(pace_t *p);
+
+#endif /* PACE_H */
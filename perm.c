@@ -0,0 +1,164 @@
+/*
+ * perm.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+
+#include <dnet.h>
+
+#include "perm.h"
+
+#define PERM_ROUNDS	6
+
+/*
+ * Keyed permutation of [0, n), for n up to 2^62. We run a Feistel
+ * network over Z_s x Z_s, s = ceil(sqrt(n)), adding the round function
+ * mod s instead of xoring (cf. Black & Rogaway, "Ciphers with Arbitrary
+ * Finite Domains"), and cycle-walk the few points of s^2 past n.
+ */
+struct perm {
+	uint64_t		 n;		/* domain size */
+	uint64_t		 s;		/* Feistel half modulus */
+	uint64_t		 key[PERM_ROUNDS];
+};
+
+perm_t *
+perm_open(uint64_t n, rand_t *rnd)
+{
+	struct perm *p;
+	uint64_t s, lo, hi;
+
+	if (n == 0 || n > (1ULL << 62) ||
+	    (p = calloc(1, sizeof(*p))) == NULL)
+		return (NULL);
+	
+	/* Least s with s * s >= n. */
+	for (lo = 1, hi = 1ULL << 31; lo < hi; ) {
+		s = lo + (hi - lo) / 2;
+		if (s * s >= n)
+			hi = s;
+		else
+			lo = s + 1;
+	}
+	p->n = n;
+	p->s = lo;
+	
+	if (rand_get(rnd, p->key, sizeof(p->key)) < 0) {
+		free(p);
+		return (NULL);
+	}
+	return (p);
+}
+
+uint64_t
+perm_count(perm_t *p)
+{
+	return (p->n);
+}
+
+/* Round function, scaled into [0, s) without a division. */
+static uint64_t
+_perm_f(perm_t *p, int r, uint64_t x)
+{
+	x = (x ^ p->key[r]) * 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 29)) * 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 32;
+	
+	return (((x & 0xffffffff) * p->s) >> 32);
+}
+
+static uint64_t
+_perm_enc(perm_t *p, uint64_t x)
+{
+	uint64_t l, r, t;
+	int i;
+
+	l = x % p->s;
+	r = x / p->s;
+	
+	for (i = 0; i < PERM_ROUNDS; i++) {
+		if ((t = l + _perm_f(p, i, r)) >= p->s)
+			t -= p->s;
+		l = r;
+		r = t;
+	}
+	return (r * p->s + l);
+}
+
+static uint64_t
+_perm_dec(perm_t *p, uint64_t x)
+{
+	uint64_t l, r, t, f;
+	int i;
+
+	l = x % p->s;
+	r = x / p->s;
+	
+	for (i = PERM_ROUNDS - 1; i >= 0; i--) {
+		f = _perm_f(p, i, l);
+		t = r >= f ? r - f : r + p->s - f;
+		r = l;
+		l = t;
+	}
+	return (r * p->s + l);
+}
+
+/* Return the i'th element of the permutation. */
+uint64_t
+perm_get(perm_t *p, uint64_t i)
+{
+	do {
+		i = _perm_enc(p, i);
+	} while (i >= p->n);
+	
+	return (i);
+}
+
+/* Return the position of v in the permutation. */
+uint64_t
+perm_inv(perm_t *p, uint64_t v)
+{
+	do {
+		v = _perm_dec(p, v);
+	} while (v >= p->n);
+	
+	return (v);
+}
+
+/*
+ * Deal positions out to shards round robin, and each shard's out to
+ * its threads: thread idx of a shard takes every (shards * threads)th
+ * position from shard + shards * idx. Return its first position at
+ * or after from, and its step.
+ */
+uint64_t
+perm_slice(uint64_t from, int shard, int shards, int idx, int threads,
+    uint64_t *step)
+{
+	uint64_t p;
+
+	*step = (uint64_t)shards * threads;
+	p = shard + (uint64_t)shards * idx;
+	
+	if (from > p)
+		p += (from - p + *step - 1) / *step * *step;
+	
+	return (p);
+}
+
+perm_t *
+perm_close(perm_t *p)
+{
+	free(p);
+	return (NULL);
+}
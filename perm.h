@@ -0,0 +1,22 @@
+/*
+ * perm.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef PERM_H
+#define PERM_H
+
+typedef struct perm perm_t;
+
+perm_t	*perm_open(uint64_t n, rand_t *rnd);
+uint64_t perm_count(perm_t *p);
+uint64_t perm_get(perm_t *p, uint64_t i);
+uint64_t perm_inv(perm_t *p, uint64_t v);
+uint64_t perm_slice(uint64_t from, int shard, int shards, int idx,
+	    int threads, uint64_t *step);
+perm_t	*perm_close(perm_t *p);
+
+#endif /* PERM_H */
@@ -0,0 +1,216 @@
+/*
+ * probe.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <dnet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "osstack.h"
+#include "probe.h"
+#include "xsk.h"
+#include "xmit.h"
+
+/*
+ * Probe headers are built once per OS personality. Per probe we only
+ * patch in the varying fields, and fold them into the template's
+ * partial checksums (cf. RFC 1624) instead of re-summing the packet.
+ */
+struct probe_tmpl {
+	u_char			 pkt[XMIT_PKT_MAX];
+	int			 len;		/* packet length */
+	int			 tsoff;		/* TCP timestamp offset */
+	uint32_t		 ts;		/* next TCP timestamp */
+	int			 ip_sum;	/* partial IP checksum */
+	int			 th_sum;	/* partial TCP/ICMP checksum */
+};
+
+struct probe {
+	uint8_t			 proto;
+	uint8_t			 tcpflags;
+	osstack_t		*os;
+	int			 cnt;
+	struct probe_tmpl	**tmpls;
+};
+
+#define cksum_add32(sum, v)	((sum) += ((v) >> 16) + ((v) & 0xffff))
+
+probe_t *
+probe_open(uint8_t proto, uint8_t tcpflags, osstack_t *os)
+{
+	struct probe *p;
+
+	if ((p = calloc(1, sizeof(*p))) != NULL) {
+		p->proto = proto;
+		p->tcpflags = tcpflags;
+		p->os = os;
+		p->cnt = proto == IP_PROTO_TCP ? osstack_syn_count(os) : 1;
+
+		if ((p->tmpls = calloc(p->cnt, sizeof(p->tmpls[0]))) == NULL) {
+			free(p);
+			return (NULL);
+		}
+	}
+	return (p);
+}
+
+static struct probe_tmpl *
+_probe_tmpl_tcp(struct probe *p, uint32_t src)
+{
+	struct probe_tmpl *t;
+	struct ip_hdr *ip;
+	struct tcp_hdr *tcp;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return (NULL);
+
+	ip = (struct ip_hdr *)t->pkt;
+	tcp = (struct tcp_hdr *)(t->pkt + IP_HDR_LEN);
+
+	/* The personality we emulate may depend on the source. */
+	ip_pack_hdr(ip, 0, IP_HDR_LEN + TCP_HDR_LEN, 0, 0, 255,
+	    IP_PROTO_TCP, src, 0);
+	tcp_pack_hdr(tcp, 0, 0, 0, 0, p->tcpflags, TCP_WIN_MAX, 0);
+
+	if ((t->len = osstack_syn_rewrite(p->os, t->pkt, sizeof(t->pkt))) < 0) {
+		free(t);
+		return (NULL);
+	}
+	if ((t->tsoff = osstack_syn_tsoff(p->os, src)) > 0) {
+		memcpy(&t->ts, t->pkt + t->tsoff, sizeof(t->ts));
+		t->ts = ntohl(t->ts);
+		memset(t->pkt + t->tsoff, 0, sizeof(t->ts));
+	}
+	ip->ip_src = 0;
+
+	t->ip_sum = ip_cksum_add(ip, IP_HDR_LEN, 0);
+	t->th_sum = ip_cksum_add(tcp, t->len - IP_HDR_LEN, 0) +
+	    htons(IP_PROTO_TCP) + htons(t->len - IP_HDR_LEN);
+
+	return (t);
+}
+
+static struct probe_tmpl *
+_probe_tmpl_icmp(struct probe *p)
+{
+	struct probe_tmpl *t;
+	struct ip_hdr *ip;
+	struct icmp_hdr *icmp;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return (NULL);
+
+	ip = (struct ip_hdr *)t->pkt;
+	icmp = (struct icmp_hdr *)(t->pkt + IP_HDR_LEN);
+
+	t->len = IP_HDR_LEN + ICMP_HDR_LEN + 12;
+	t->tsoff = -1;
+	ip_pack_hdr(ip, 0, t->len, 0, 0, 255, IP_PROTO_ICMP, 0, 0);
+	icmp->icmp_type = ICMP_ECHO;
+	icmp->icmp_code = ICMP_CODE_NONE;
+
+	t->ip_sum = ip_cksum_add(ip, IP_HDR_LEN, 0);
+	t->th_sum = ip_cksum_add(icmp, t->len - IP_HDR_LEN, 0);
+
+	return (t);
+}
+
+int
+probe_build(probe_t *p, u_char *buf, uint32_t src, uint32_t dst,
+    uint16_t id, uint16_t sport, uint16_t dport, uint32_t cookie)
+{
+	struct probe_tmpl *t, **tp;
+	struct ip_hdr *ip;
+	struct tcp_hdr *tcp;
+	struct icmp_hdr *icmp;
+	struct timeval tv;
+	uint32_t val;
+	int sum;
+
+	if (p->proto == IP_PROTO_TCP) {
+		tp = &p->tmpls[osstack_syn_index(p->os, src)];
+		if (*tp == NULL && (*tp = _probe_tmpl_tcp(p, src)) == NULL)
+			return (-1);
+	} else {
+		tp = &p->tmpls[0];
+		if (*tp == NULL && (*tp = _probe_tmpl_icmp(p)) == NULL)
+			return (-1);
+	}
+	t = *tp;
+	memcpy(buf, t->pkt, t->len);
+
+	ip = (struct ip_hdr *)buf;
+	ip->ip_id = htons(id);
+	ip->ip_src = src;
+	ip->ip_dst = dst;
+
+	sum = t->ip_sum + ip->ip_id;
+	cksum_add32(sum, src);
+	cksum_add32(sum, dst);
+	ip->ip_sum = ip_cksum_carry(sum);
+
+	if (p->proto == IP_PROTO_TCP) {
+		tcp = (struct tcp_hdr *)(buf + IP_HDR_LEN);
+		tcp->th_sport = htons(sport);
+		tcp->th_dport = htons(dport);
+		tcp->th_seq = htonl(cookie);
+
+		sum = t->th_sum + tcp->th_sport + tcp->th_dport;
+		cksum_add32(sum, src);
+		cksum_add32(sum, dst);
+		cksum_add32(sum, tcp->th_seq);
+
+		if (t->tsoff > 0) {
+			val = htonl(t->ts++);
+			memcpy(buf + t->tsoff, &val, sizeof(val));
+			cksum_add32(sum, val);
+		}
+		tcp->th_sum = ip_cksum_carry(sum);
+	} else {
+		icmp = (struct icmp_hdr *)(buf + IP_HDR_LEN);
+
+		val = htonl(cookie);
+		memcpy(buf + IP_HDR_LEN + ICMP_HDR_LEN, &val, sizeof(val));
+		sum = t->th_sum;
+		cksum_add32(sum, val);
+
+		gettimeofday(&tv, NULL);
+		val = htonl(tv.tv_sec);
+		memcpy(buf + IP_HDR_LEN + ICMP_HDR_LEN + 4, &val, sizeof(val));
+		cksum_add32(sum, val);
+		val = htonl(tv.tv_usec);
+		memcpy(buf + IP_HDR_LEN + ICMP_HDR_LEN + 8, &val, sizeof(val));
+		cksum_add32(sum, val);
+
+		icmp->icmp_cksum = ip_cksum_carry(sum);
+	}
+	return (t->len);
+}
+
+probe_t *
+probe_close(probe_t *p)
+{
+	int i;
+
+	for (i = 0; i < p->cnt; i++) {
+		if (p->tmpls[i] != NULL)
+			free(p->tmpls[i]);
+	}
+	free(p->tmpls);
+	free(p);
+
+	return (NULL);
+}
@@ -0,0 +1,19 @@
+/*
+ * probe.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+typedef struct probe probe_t;
+
+probe_t	*probe_open(uint8_t proto, uint8_t tcpflags, osstack_t *os);
+int	 probe_build(probe_t *p, u_char *buf, uint32_t src, uint32_t dst,
+	    uint16_t id, uint16_t sport, uint16_t dport, uint32_t cookie);
+probe_t	*probe_close(probe_t *p);
+
+#endif /* PROBE_H */
@@ -27,8 +27,14 @@
 
 #include "ares.h"
 #include "bag.h"
+#include "ckpt.h"
+#include "dedup.h"
 #include "dscan.h"
+#include "excl.h"
 #include "osstack.h"
+#include "perm.h"
+#include "rxring.h"
+#include "xsk.h"
 #include "dscan-int.h"
 #include "hash.h"
 #include "mysignal.h"
@@ -36,6 +42,11 @@
 #include "pcaputil.h"
 #include "print.h"
 
+#define RECV_FILTER	"tcp[13] = 0x12 or icmp[0] = 0"
+/* Link header, and IP and TCP with all their options. */
+#define RECV_SNAPLEN	(ETH_HDR_LEN + IP_HDR_LEN_MAX + TCP_HDR_LEN_MAX)
+#define RECV_ECHO_LEN	(IP_HDR_LEN + ICMP_HDR_LEN + 4 + 8)
+
 struct recv_result {
 	uint32_t	 ip;
 	int		 proto;
@@ -48,91 +59,146 @@ extern int		(*event_sigcb)(void);
 extern int		  event_gotsig;
 
 static void
-recv_print(uint32_t ip, const char *name, void *arg)
+recv_output(const struct recv_result *res, const char *name)
 {
-	struct recv_result *res = (struct recv_result *)arg;
 	char pbuf[16];
 
 	snprintf(pbuf, sizeof(pbuf), "%s/%d",
 	    ndb_proto_name(res->proto), res->port);
 	printf("%-16s %-34s %-10s %s\n",
 	    ip_ntoa(&res->ip), name ? name : "???", pbuf, res->data);
-	
+}
+
+static void
+recv_print(uint32_t ip, const char *name, void *arg)
+{
+	struct recv_result *res = (struct recv_result *)arg;
+
+	recv_output(res, name);
 	fflush(stdout);
 	free(res);
 }
 
+/* Replies captured in this dispatch, waiting on their cookie check. */
+static struct recv_queue {
+	struct hash_batch	 hb;
+	struct {
+		int		 proto;
+		int		 port;
+		struct timeval	 ts;		/* capture time */
+		struct timeval	 sent;		/* echo timestamp */
+	} r[HASH_BATCH];
+} recv_queue;
+
 static void
-recv_pcap_cb(u_char *u, const struct pcap_pkthdr *h, const u_char *p)
+recv_flush(struct dscan_ctx *ctx)
 {
-	struct dscan_dif *dif = (struct dscan_dif *)u;
-	struct dscan_pkt *pkt;
-	struct recv_result *res;
+	struct recv_queue *q = &recv_queue;
+	struct recv_result r, *res;
 	struct timeval tv;
-	uint32_t hash, tmp;
-	int hash_ok;
+	quad_t usec;
+	uint32_t hash, mask;
+	int i;
 
-	/* XXX - BPF bounds-checks up to the transport header in our filter */
-	pkt = (struct dscan_pkt *)(p + pcap_dloff(dif->pcap));
+	mask = hash_cookie_verify(ctx->ckey, &q->hb);
 	
-	if (pkt->pkt_ip.ip_hl != 5 ||
-	    (u_char *)&pkt->pkt_ip + ntohs(pkt->pkt_ip.ip_len) > p + h->len)
-		return;
-	
-	/* Compute hash. */
-	hash_ok = 0;
-	hash_init(&hash);
-	hash_update(&hash, &dif->ctx->key, sizeof(dif->ctx->key));
-	hash_update(&hash, &pkt->pkt_ip.ip_p, sizeof(pkt->pkt_ip.ip_p));
-	hash_update(&hash, &pkt->pkt_ip.ip_dst, 4);
-	hash_update(&hash, &pkt->pkt_ip.ip_src, 4);
-
-	if (pkt->pkt_ip.ip_p == IP_PROTO_TCP) {
-		hash_update(&hash, &pkt->pkt_tcp.th_sport, 2);
-		if (hash == ntohl(pkt->pkt_tcp.th_ack) - 1)
-			hash_ok = 1;
-	} else if (pkt->pkt_ip.ip_p == IP_PROTO_ICMP &&
-	    pkt->pkt_icmp.icmp_type == ICMP_ECHOREPLY) {
-		hash_update(&hash, &pkt->pkt_icmp, 2);
-		memcpy(&tmp, &pkt->pkt_icmp_msg.echo, 4);
-		if (hash == ntohl(tmp))
-			hash_ok = 1;
-	}
-	/* Make sure this is a scan reply we haven't seen yet. */
-	if (hash_ok && dif->ctx->hcache[hash % dif->ctx->hcache_sz] != hash) {
-		dif->ctx->hcache[hash % dif->ctx->hcache_sz] = hash;
+	for (i = 0; i < q->hb.cnt; i++) {
+		if ((mask & (1 << i)) == 0)
+			continue;
+		
+		/* Make sure this is a scan reply we haven't seen yet. */
+		hash = q->hb.cookie[i];
+		if (ctx->hcache[hash % ctx->hcache_sz] == hash)
+			continue;
+		ctx->hcache[hash % ctx->hcache_sz] = hash;
 		
-		res = malloc(sizeof(*res));
-		res->ip = pkt->pkt_ip.ip_src;
-		res->proto = pkt->pkt_ip.ip_p;
+		r.ip = q->hb.dst[i];
+		r.proto = q->r[i].proto;
+		r.port = q->r[i].port;
 		
-		if (res->proto == IP_PROTO_TCP) {
-			res->port = ntohs(pkt->pkt_tcp.th_sport);
-			strlcpy(res->data, ndb_serv_name(IP_PROTO_TCP,
-			    res->port), sizeof(res->data));
-		} else if (res->proto == IP_PROTO_ICMP &&
-		    pkt->pkt_icmp.icmp_type == ICMP_ECHOREPLY) {
-			quad_t usec;
-
-			res->port = ICMP_ECHO;
-			tv.tv_sec = ntohl(*(uint32_t *)
-			    &pkt->pkt_icmp_msg.echo.icmp_data[0]);
-			tv.tv_usec = ntohl(*(uint32_t *)
-			    &pkt->pkt_icmp_msg.echo.icmp_data[4]);
-			timersub(&h->ts, &tv, &tv);
+		if (r.proto == IP_PROTO_TCP) {
+			strlcpy(r.data, ndb_serv_name(IP_PROTO_TCP,
+			    r.port), sizeof(r.data));
+		} else {
+			timersub(&q->r[i].ts, &q->r[i].sent, &tv);
 			usec = (tv.tv_sec * 1000000) + tv.tv_usec;
-			snprintf(res->data, sizeof(res->data),
+			snprintf(r.data, sizeof(r.data),
 			    "echo (%d.%03d ms)",
 			    (int)(usec / 1000), (int)(usec % 1000));
-		} else
-			err(1, "fubar");
-		
-		/* Print reply. */
-		if (dif->ctx->resolv)
+		}
+		/* Print reply, once its name's resolved. */
+		if (ctx->resolv) {
+			if ((res = malloc(sizeof(*res))) == NULL)
+				continue;
+			memcpy(res, &r, sizeof(*res));
 			ares_query(res->ip, recv_print, res);
-		else 
-			recv_print(res->ip, "", res);
+		} else
+			recv_output(&r, "");
 	}
+	/* Unresolved replies go out a batch at a time. */
+	if (!ctx->resolv && q->hb.cnt > 0)
+		fflush(stdout);
+	q->hb.cnt = 0;
+}
+
+/* Queue a reply from its IP header at p, up to end. */
+static void
+recv_pkt(struct dscan_dif *dif, const struct timeval *ts, const u_char *p,
+    const u_char *end)
+{
+	struct recv_queue *q = &recv_queue;
+	struct dscan_pkt *pkt;
+	uint32_t tmp;
+	int i, len;
+
+	/* XXX - BPF bounds-checks up to the transport header in our filter */
+	pkt = (struct dscan_pkt *)p;
+	
+	if (pkt->pkt_ip.ip_hl != 5)
+		return;
+	
+	/* Only what we parse need be captured, not any options after. */
+	len = pkt->pkt_ip.ip_p == IP_PROTO_TCP ?
+	    IP_HDR_LEN + TCP_HDR_LEN : RECV_ECHO_LEN;
+	
+	if (p + len > end || ntohs(pkt->pkt_ip.ip_len) < len)
+		return;
+	
+	/* Queue the tuple its cookie was computed over. */
+	i = q->hb.cnt;
+	q->hb.src[i] = pkt->pkt_ip.ip_dst;
+	q->hb.dst[i] = pkt->pkt_ip.ip_src;
+	q->r[i].proto = pkt->pkt_ip.ip_p;
+	q->r[i].ts = *ts;
+	
+	if (pkt->pkt_ip.ip_p == IP_PROTO_TCP) {
+		q->r[i].port = ntohs(pkt->pkt_tcp.th_sport);
+		q->hb.port[i] = (IP_PROTO_TCP << 16) | q->r[i].port;
+		q->hb.cookie[i] = ntohl(pkt->pkt_tcp.th_ack) - 1;
+	} else if (pkt->pkt_ip.ip_p == IP_PROTO_ICMP &&
+	    pkt->pkt_icmp.icmp_type == ICMP_ECHOREPLY) {
+		q->r[i].port = ICMP_ECHO;
+		q->hb.port[i] = (IP_PROTO_ICMP << 16) |
+		    (pkt->pkt_icmp.icmp_type << 8) | pkt->pkt_icmp.icmp_code;
+		memcpy(&tmp, &pkt->pkt_icmp_msg.echo, 4);
+		q->hb.cookie[i] = ntohl(tmp);
+		q->r[i].sent.tv_sec = ntohl(*(uint32_t *)
+		    &pkt->pkt_icmp_msg.echo.icmp_data[0]);
+		q->r[i].sent.tv_usec = ntohl(*(uint32_t *)
+		    &pkt->pkt_icmp_msg.echo.icmp_data[4]);
+	} else
+		return;
+	
+	if (++q->hb.cnt == HASH_BATCH)
+		recv_flush(dif->ctx);
+}
+
+static void
+recv_pcap_cb(u_char *u, const struct pcap_pkthdr *h, const u_char *p)
+{
+	struct dscan_dif *dif = (struct dscan_dif *)u;
+
+	recv_pkt(dif, &h->ts, p + pcap_dloff(dif->pcap), p + h->caplen);
 }
 
 static void
@@ -141,6 +207,48 @@ recv_event_cb(int fd, short event, void *arg)
 	struct dscan_dif *dif = (struct dscan_dif *)arg;
 
 	pcap_dispatch(dif->pcap, -1, recv_pcap_cb, (u_char *)dif);
+	recv_flush(dif->ctx);
+	event_add(&dif->ev, NULL);	/* XXX - older libevent */
+}
+
+static void
+recv_rxring_cb(void *arg, const struct timeval *ts, const u_char *p,
+    int caplen, int len)
+{
+	struct dscan_dif *dif = (struct dscan_dif *)arg;
+
+	recv_pkt(dif, ts, p, p + caplen);
+}
+
+static void
+recv_rxring_event_cb(int fd, short event, void *arg)
+{
+	struct dscan_dif *dif = (struct dscan_dif *)arg;
+
+	rxring_recv(dif->rxring, recv_rxring_cb, dif);
+	recv_flush(dif->ctx);
+	event_add(&dif->ev, NULL);	/* XXX - older libevent */
+}
+
+/* AF_XDP has no timestamps of its own: stamp each ring's worth. */
+static struct timeval recv_xsk_ts;
+
+static void
+recv_xsk_cb(void *arg, const u_char *p, int len)
+{
+	struct dscan_dif *dif = (struct dscan_dif *)arg;
+
+	recv_pkt(dif, &recv_xsk_ts, p + ETH_HDR_LEN, p + len);
+}
+
+static void
+recv_xsk_event_cb(int fd, short event, void *arg)
+{
+	struct dscan_dif *dif = (struct dscan_dif *)arg;
+
+	gettimeofday(&recv_xsk_ts, NULL);
+	xsk_recv(dif->xsk, recv_xsk_cb, dif);
+	recv_flush(dif->ctx);
 	event_add(&dif->ev, NULL);	/* XXX - older libevent */
 }
 
@@ -190,6 +298,7 @@ dscan_recv(struct dscan_ctx *ctx)
 {
 	struct dscan_dif *dif;
 	struct pcap_stat ps;
+	u_int drops;
 
 #ifdef HAVE_SETPROCTITLE
 	setproctitle("recv");
@@ -215,17 +324,29 @@ dscan_recv(struct dscan_ctx *ctx)
 	 * XXX - assumes symmetric routes
 	 */
 	TAILQ_FOREACH(dif, &ctx->difs, next) {
-		if (!(dif->pcap = pcap_open(dif->ifent.intf_name, 0, 31337)) ||
-		    pcap_filter(dif->pcap, "tcp[13] = 0x12 or icmp[0] = 0")) {
-			err(1, "couldn't open %s for sniffing",
-			    dif->ifent.intf_name);
+		if (dif->xsk != NULL) {
+			/* Our XDP program does the filtering. */
+			event_set(&dif->ev, xsk_fd(dif->xsk), EV_READ,
+			    recv_xsk_event_cb, dif);
+		} else if ((dif->rxring = rxring_open(dif->ifent.intf_name,
+		    RECV_SNAPLEN, RECV_FILTER)) != NULL) {
+			event_set(&dif->ev, rxring_fd(dif->rxring), EV_READ,
+			    recv_rxring_event_cb, dif);
+		} else {
+			/* No RX ring here: fall back to pcap. */
+			if (!(dif->pcap = pcap_open(dif->ifent.intf_name,
+			    0, RECV_SNAPLEN)) ||
+			    pcap_filter(dif->pcap, RECV_FILTER)) {
+				err(1, "couldn't open %s for sniffing",
+				    dif->ifent.intf_name);
+			}
+			event_set(&dif->ev, pcap_fileno(dif->pcap), EV_READ,
+			    recv_event_cb, dif);
 		}
 		if (ctx->mode == DSCAN_RECV)
 			fprintf(stderr, "listening on %s\n",
 			    dif->ifent.intf_name);
 		
-		event_set(&dif->ev, pcap_fileno(dif->pcap), EV_READ,
-		    recv_event_cb, dif);
 		event_add(&dif->ev, NULL);
 	}
 	event_sigcb = recv_sigcb;
@@ -236,7 +357,7 @@ dscan_recv(struct dscan_ctx *ctx)
 	recv_drop_privs();
 	event_dispatch();
 	
-	fprintf(stderr, "Scan finished: key %u", ctx->key);
+	fprintf(stderr, "Scan finished: key %s", dscan_get_key(ctx));
 	if (ctx->duration > 0)
 		fprintf(stderr, ", %s", print_duration(ctx->duration));
 	fputc('\n', stderr);
@@ -249,6 +370,12 @@ dscan_recv(struct dscan_ctx *ctx)
 			pcap_close(dif->pcap);
 			dif->pcap = NULL;
 		}
+		if (dif->rxring != NULL) {
+			if (rxring_drops(dif->rxring, &drops) == 0 && drops > 0)
+				warnx("%s: dropped %u packets",
+				    dif->ifent.intf_name, drops);
+			dif->rxring = rxring_close(dif->rxring);
+		}
 	}
 #if 0
 	if (ctx->resolv)
@@ -0,0 +1,239 @@
+/*
+ * rxring.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef __linux__
+# include <sys/mman.h>
+# include <linux/filter.h>
+# include <linux/if_ether.h>
+# include <linux/if_packet.h>
+# include <net/if.h>
+# include <arpa/inet.h>
+#endif
+
+#include <pcap.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rxring.h"
+
+#if defined(PACKET_RX_RING) && defined(TPACKET3_HDRLEN)
+#define RXRING_BLOCKSZ		(256 * 1024)	/* thousands of replies */
+#define RXRING_BLOCKS		64
+#define RXRING_FRAMESZ		2048		/* unused by TPACKET_V3 */
+#define RXRING_TIMEOUT		10		/* ms to retire a block */
+
+#define rxring_barrier()	__sync_synchronize()
+
+/*
+ * A TPACKET_V3 receive ring: the kernel fills whole blocks of packets,
+ * cut to snaplen by our filter, and hands each over when it's full or
+ * RXRING_TIMEOUT has passed, so we're woken once a block, not once a
+ * packet. Packets start at their IP header, whatever the link type.
+ */
+struct rxring {
+	int			 fd;		/* packet socket */
+	u_char			*ring;		/* mmap'ed RX ring */
+	size_t			 ringsz;	/* ring size in bytes */
+	int			 cur;		/* next block to read */
+};
+
+#define RXRING_BLOCK(r, i)	\
+	((struct tpacket_block_desc *)((r)->ring + ((i) * RXRING_BLOCKSZ)))
+
+/* Compile filter for raw IP, and attach it to the socket. */
+static int
+_rxring_filter(rxring_t *r, int snaplen, const char *filter)
+{
+	struct bpf_program fcode;
+	struct sock_fprog fprog;
+	pcap_t *pd;
+	int ret = -1;
+
+	if ((pd = pcap_open_dead(DLT_RAW, snaplen)) == NULL)
+		return (-1);
+
+	if (pcap_compile(pd, &fcode, (char *)filter, 1, 0) == 0) {
+		fprog.len = fcode.bf_len;
+		fprog.filter = (struct sock_filter *)fcode.bf_insns;
+
+		ret = setsockopt(r->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		    &fprog, sizeof(fprog));
+		pcap_freecode(&fcode);
+	}
+	pcap_close(pd);
+
+	return (ret);
+}
+
+rxring_t *
+rxring_open(const char *name, int snaplen, const char *filter)
+{
+	struct sockaddr_ll sll;
+	struct tpacket_req3 req;
+	rxring_t *r;
+	int n;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		return (NULL);
+
+	/* Unbound until the filter's on, so nothing gets by it. */
+	if ((r->fd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0)
+		return (rxring_close(r));
+
+	if (_rxring_filter(r, snaplen, filter) < 0)
+		return (rxring_close(r));
+
+	n = TPACKET_V3;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &n, sizeof(n)) < 0)
+		return (rxring_close(r));
+#ifdef PACKET_IGNORE_OUTGOING
+	n = 1;
+	setsockopt(r->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &n, sizeof(n));
+#endif
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RXRING_BLOCKSZ;
+	req.tp_block_nr = RXRING_BLOCKS;
+	req.tp_frame_size = RXRING_FRAMESZ;
+	req.tp_frame_nr = (RXRING_BLOCKSZ / RXRING_FRAMESZ) * RXRING_BLOCKS;
+	req.tp_retire_blk_tov = RXRING_TIMEOUT;
+
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING,
+		&req, sizeof(req)) < 0)
+		return (rxring_close(r));
+
+	r->ringsz = (size_t)RXRING_BLOCKSZ * RXRING_BLOCKS;
+
+	if ((r->ring = mmap(NULL, r->ringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, 0)) == MAP_FAILED) {
+		r->ring = NULL;
+		return (rxring_close(r));
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+
+	if ((sll.sll_ifindex = if_nametoindex(name)) == 0 ||
+	    bind(r->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		return (rxring_close(r));
+
+	return (r);
+}
+
+int
+rxring_fd(rxring_t *r)
+{
+	return (r->fd);
+}
+
+/* Pass each packet in every block handed over to callback. */
+int
+rxring_recv(rxring_t *r, rxring_handler callback, void *arg)
+{
+	struct tpacket_block_desc *b;
+	struct tpacket3_hdr *h;
+	struct timeval tv;
+	uint32_t i;
+	int n = 0;
+
+	for (;;) {
+		b = RXRING_BLOCK(r, r->cur);
+
+		if ((b->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+			break;
+		rxring_barrier();
+
+		h = (struct tpacket3_hdr *)((u_char *)b +
+		    b->hdr.bh1.offset_to_first_pkt);
+
+		for (i = 0; i < b->hdr.bh1.num_pkts; i++) {
+			tv.tv_sec = h->tp_sec;
+			tv.tv_usec = h->tp_nsec / 1000;
+			callback(arg, &tv, (u_char *)h + h->tp_mac,
+			    h->tp_snaplen, h->tp_len);
+			h = (struct tpacket3_hdr *)((u_char *)h +
+			    h->tp_next_offset);
+		}
+		n += b->hdr.bh1.num_pkts;
+
+		/* Retire the whole block back to the kernel at once. */
+		rxring_barrier();
+		b->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		r->cur = (r->cur + 1) % RXRING_BLOCKS;
+	}
+	return (n);
+}
+
+/* Return the count of packets dropped for lack of room, and reset it. */
+int
+rxring_drops(rxring_t *r, u_int *drops)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	if (getsockopt(r->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+		return (-1);
+
+	*drops = st.tp_drops;
+	return (0);
+}
+
+rxring_t *
+rxring_close(rxring_t *r)
+{
+	if (r->ring != NULL)
+		munmap(r->ring, r->ringsz);
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r);
+
+	return (NULL);
+}
+#else /* !TPACKET3_HDRLEN */
+rxring_t *
+rxring_open(const char *name, int snaplen, const char *filter)
+{
+	errno = EOPNOTSUPP;
+	return (NULL);
+}
+
+int
+rxring_fd(rxring_t *r)
+{
+	return (-1);
+}
+
+int
+rxring_recv(rxring_t *r, rxring_handler callback, void *arg)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+int
+rxring_drops(rxring_t *r, u_int *drops)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+rxring_t *
+rxring_close(rxring_t *r)
+{
+	return (NULL);
+}
+#endif /* !TPACKET3_HDRLEN */
@@ -0,0 +1,23 @@
+/*
+ * rxring.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef RXRING_H
+#define RXRING_H
+
+typedef struct rxring rxring_t;
+
+typedef void (*rxring_handler)(void *arg, const struct timeval *ts,
+    const u_char *pkt, int caplen, int len);
+
+rxring_t *rxring_open(const char *name, int snaplen, const char *filter);
+int	 rxring_fd(rxring_t *r);
+int	 rxring_recv(rxring_t *r, rxring_handler callback, void *arg);
+int	 rxring_drops(rxring_t *r, u_int *drops);
+rxring_t *rxring_close(rxring_t *r);
+
+#endif /* RXRING_H */
@@ -10,6 +10,7 @@
 # include "config.h"
 #endif
 
+#include <sys/param.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 #include <sys/time.h>
@@ -18,210 +19,516 @@
 #include <dnet.h>
 #include <pcap.h>
 
-#include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bag.h"
+#include "ckpt.h"
+#include "dedup.h"
 #include "dscan.h"
+#include "excl.h"
+#include "input.h"
 #include "osstack.h"
+#include "pace.h"
+#include "perm.h"
+#include "probe.h"
+#include "rxring.h"
+#include "xsk.h"
 #include "dscan-int.h"
 #include "hash.h"
 #include "mysignal.h"
 #include "print.h"
+#include "xmit.h"
 
-static uint32_t		scan_gotsig;
-static uint32_t		scan_ticks;
+#define SCAN_CKPT_SECS	10		/* checkpoint interval */
+#define SCAN_RESOLVE_BATCH 1024		/* targets to xmit_resolve() */
+
+static volatile uint32_t	scan_gotsig;
+
+struct scan_thread {
+	struct dscan_ctx	*ctx;
+	int			 idx;		/* shard index */
+	pthread_t		 thread;
+	xmit_t			*xmit;		/* transmit handle */
+	probe_t			*probe;		/* probe templates */
+	pace_t			*pace;		/* rate limiter */
+	struct hash_batch	 hb;		/* probes to stamp */
+	uint64_t		 stalls;	/* waits for room to send */
+	uint64_t		 unresolved;	/* probes with no next hop */
+	
+	/* Progress, for checkpoints */
+	volatile int		 difidx;	/* interface we're on */
+	volatile uint64_t	 pos;		/* next walk position */
+	volatile uint64_t	 sent;		/* bytes sent */
+	volatile off_t		 offset;	/* input bytes consumed */
+	volatile uint32_t	 line;		/* input lines consumed */
+};
+
+static struct scan_thread	*scan_threads;
+
+static pthread_mutex_t		 scan_ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 scan_ckpt_cond = PTHREAD_COND_INITIALIZER;
+static int			 scan_ckpt_done;
 
 static int
-scan_send(ip_t *ip, struct dscan_ctx *ctx,
-    uint32_t src, uint32_t dst, uint16_t dport)
+scan_send(struct scan_thread *st, int i)
 {
-	struct dscan_pkt *pkt;
-	struct timeval tv;
-	uint32_t hash;
-	u_char buf[BUFSIZ];
+	struct hash_batch *hb = &st->hb;
+	uint16_t id, sport;
+	u_char *buf;
 	int len;
 
-	hash_init(&hash);
-	hash_update(&hash, &ctx->key, sizeof(ctx->key));
-	hash_update(&hash, &ctx->proto, 1);
-	hash_update(&hash, &src, 4);
-	hash_update(&hash, &dst, 4);
-	
-	pkt = (struct dscan_pkt *)buf;
-
-	if (ctx->mode == DSCAN_TCP) {
-		len = IP_HDR_LEN + TCP_HDR_LEN;
-		ip_pack_hdr(&pkt->pkt_ip, 0, len, rand_uint16(ctx->rnd),
-		    0, 255, ctx->proto, src, dst);
-		tcp_pack_hdr(&pkt->pkt_tcp, rand_uint16(ctx->rnd), dport,
-		    0, 0, ctx->tcpflags, TCP_WIN_MAX, 0);
-		hash_update(&hash, &pkt->pkt_tcp.th_dport, 2);
-		pkt->pkt_tcp.th_seq = htonl(hash);
-		len = osstack_syn_rewrite(ctx->osstack, buf, sizeof(buf));
-	} else if (ctx->mode == DSCAN_PING) {
-		len = IP_HDR_LEN + ICMP_HDR_LEN + 12;
-		ip_pack_hdr(&pkt->pkt_ip, 0, len, rand_uint16(ctx->rnd),
-		    0, 255, ctx->proto, src, dst);
-		pkt->pkt_icmp.icmp_type = ICMP_ECHOREPLY;
-		pkt->pkt_icmp.icmp_code = ICMP_CODE_NONE;
-		hash_update(&hash, &pkt->pkt_icmp, 2);
-		hash = htonl(hash);
-
-		pkt->pkt_icmp.icmp_type = ICMP_ECHO;
-		memcpy(&pkt->pkt_icmp_msg.echo, &hash, 4);
+	if ((buf = xmit_buf(st->xmit)) == NULL)
+		return (-1);
+
+	/* The cookie's high bits are keyed noise we don't send back. */
+	id = hb->hash[i] >> 32;
+	sport = st->ctx->mode == DSCAN_TCP ? hb->hash[i] >> 48 : 0;
+	
+	if ((len = probe_build(st->probe, buf, hb->src[i], hb->dst[i], id,
+	    sport, hb->port[i] & 0xffff, (uint32_t)hb->hash[i])) < 0)
+		return (-1);
+	
+	/* Let the qdisc space them out, while we run ahead. */
+	if (PACE_LAUNCH(st->ctx->pacing))
+		return (xmit_add_at(st->xmit, len, pace_time(st->pace)));
+	
+	return (xmit_add(st->xmit, len));
+}
+
+static void
+scan_pace(struct scan_thread *st, uint32_t bytes)
+{
+	pace_add(st->pace, bytes);
+	st->sent += bytes;
+	
+	if (!pace_ready(st->pace)) {
+		/* Don't let queued probes sit out the wait. */
+		while (xmit_flush(st->xmit) < 0 && !scan_gotsig)
+			warn("send");
 		
-		gettimeofday(&tv, NULL);
-		*(uint32_t *)&pkt->pkt_icmp_msg.echo.icmp_data[0] =
-		    htonl(tv.tv_sec);
-		*(uint32_t *)&pkt->pkt_icmp_msg.echo.icmp_data[4] =
-		    htonl(tv.tv_usec);
+		pace_wait(st->pace, &scan_gotsig);
+	}
+}
+
+/* Compute cookies for the queued probes at once, then send them. */
+static void
+scan_stamp(struct scan_thread *st)
+{
+	int i, n;
+
+	hash_cookie_batch(st->ctx->ckey, &st->hb);
+	
+	/*
+	 * xmit waits out a full queue, until we're signalled; a probe
+	 * that fails is dropped.
+	 */
+	for (i = 0; i < st->hb.cnt; i++) {
+		if ((n = scan_send(st, i)) >= 0)
+			scan_pace(st, n);
+		else if (scan_gotsig)
+			break;
+		else
+			warn("send");
+	}
+	st->hb.cnt = 0;
+}
+
+static void
+scan_queue(struct scan_thread *st, uint32_t src, uint32_t dst, uint16_t dport)
+{
+	struct hash_batch *hb = &st->hb;
+	
+	hb->src[hb->cnt] = src;
+	hb->dst[hb->cnt] = dst;
+	
+	if (st->ctx->mode == DSCAN_TCP) {
+		hb->port[hb->cnt] = (IP_PROTO_TCP << 16) | dport;
+	} else if (st->ctx->mode == DSCAN_PING) {
+		/* Hash the reply we expect back. */
+		hb->port[hb->cnt] = (IP_PROTO_ICMP << 16) |
+		    (ICMP_ECHOREPLY << 8) | ICMP_CODE_NONE;
 	} else
-		errx(1, "unknown mode %d", ctx->mode);
+		errx(1, "unknown mode %d", st->ctx->mode);
+	
+	if (++hb->cnt == HASH_BATCH)
+		scan_stamp(st);
+}
+
+/*
+ * Position p of the scan is target (i / nports), port (i % nports) of
+ * the target x port product, for i = p or its permutation if we're
+ * randomizing. Sources are spoofed round robin. Shards and their
+ * threads take the positions perm_slice() deals them. In order,
+ * a target's ports run back to back, so we look it up once for all of
+ * them, and its cookies share their (src, dst) hashing.
+ */
+static void
+scan_dst(struct scan_thread *st, struct dscan_dif *dif)
+{
+	struct dscan_ctx *ctx = st->ctx;
+	uint64_t i, j, p, n, step;
+	uint32_t nports, nsrcs, sip, dip, port;
+	
+	nports = bag_count(ctx->ports);
+	nsrcs = ctx->srcs != NULL ? bag_count(ctx->srcs) : 0;
+	n = (uint64_t)bag_count(dif->dsts) * nports;
+	sip = dif->ifent.intf_addr.addr_ip;
 	
-	ip_checksum(pkt, len);
+	/* Pick up at our first position not yet sent. */
+	p = perm_slice(dif->pos, ctx->shard, ctx->shards, st->idx,
+	    ctx->threads, &step);
 	
-	return (ip_send(ip, pkt, len));
+	for (j = n; p < n && !scan_gotsig; p += step) {
+		st->pos = p;
+		i = dif->perm != NULL ? perm_get(dif->perm, p) : p;
+		
+		if (i / nports != j) {
+			j = i / nports;
+			bag_index(dif->dsts, j, &dip);
+		}
+		bag_index(ctx->ports, i % nports, &port);
+		
+		if (nsrcs > 0) {
+			bag_index(ctx->srcs, p % nsrcs, &sip);
+			sip = htonl(sip);
+		}
+		scan_queue(st, sip, htonl(dip), port);
+	}
+	st->pos = p;
 }
 
+/*
+ * Have xmit resolve the next hops of our targets on the interface's
+ * subnet before we send to any of them. Everything else goes to a
+ * gateway, so only the (sorted) run of targets in the subnet is
+ * looked up.
+ */
 static void
-scan_dst(ip_t *ip, struct dscan_ctx *ctx, struct dscan_dif *dif)
+scan_resolve(struct scan_thread *st, struct dscan_dif *dif)
 {
-	uint32_t sip, dip, port, n, bytes = 0;
+	uint32_t dsts[SCAN_RESOLVE_BATCH];
+	uint32_t i, lo, hi, net, bcast, mask, v;
+	int bits, n;
+
+	if ((bits = dif->ifent.intf_addr.addr_bits) == 0)
+		return;
+	
+	mask = 0xffffffffU << (IP_ADDR_BITS - bits);
+	net = ntohl(dif->ifent.intf_addr.addr_ip) & mask;
+	bcast = net | ~mask;
+	
+	/* Find the first target in the subnet. */
+	for (lo = 0, hi = bag_count(dif->dsts); lo < hi; ) {
+		i = lo + (hi - lo) / 2;
+		bag_index(dif->dsts, i, &v);
+		if (v < net)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	for (i = lo, n = 0; bag_index(dif->dsts, i, &v) == 0 && v <= bcast;
+	    i++) {
+		dsts[n++] = htonl(v);
+		if (n == SCAN_RESOLVE_BATCH) {
+			if (xmit_resolve(st->xmit, dsts, n) < 0)
+				err(1, "couldn't resolve next hops");
+			n = 0;
+		}
+	}
+	if (n > 0 && xmit_resolve(st->xmit, dsts, n) < 0)
+		err(1, "couldn't resolve next hops");
+}
 
+/*
+ * Targets read from input are sent a window at a time, as they're read.
+ * Each window x ports is walked in order, or shuffled once it's all
+ * read if we're randomizing, so a sorted hitlist doesn't hit one
+ * network at a time.
+ */
+static void
+scan_dst_input(struct scan_thread *st, struct dscan_dif *dif)
+{
+	struct dscan_ctx *ctx = st->ctx;
+	struct input_win *w;
+	input_t *in;
+	perm_t *perm = NULL;
+	uint64_t i, p, n;
+	uint32_t nports, sip, port, cnt, sent = 0;
+	int done;
+	
 	sip = dif->ifent.intf_addr.addr_ip;
+	nports = bag_count(ctx->ports);
+	
+	if ((in = input_open(ctx)) == NULL)
+		err(1, "couldn't read targets");
+	
+	if (ctx->random &&
+	    rand_set(ctx->rnd, &ctx->key, sizeof(ctx->key)) < 0)
+		err(1, "couldn't randomize scan order");
 	
-	while (bag_iter(dif->dsts, &dip) == 0 && !scan_gotsig) {
-		while (bag_iter(ctx->ports, &port) == 0 && !scan_gotsig) {
-			if (ctx->srcs != NULL) {
-				while (bag_iter(ctx->srcs, &sip) < 0)
-					bag_refill(ctx->srcs);
-				sip = htonl(sip);
-			}			
-			while ((n = scan_send(ip, ctx, sip, htonl(dip),
-			    port)) < 0)
+	while (!scan_gotsig && (w = input_get(in, &cnt, &done)) != NULL) {
+		if (!done && (ctx->random || cnt == sent)) {
+			/* Don't let queued probes sit out the wait. */
+			scan_stamp(st);
+			while (xmit_flush(st->xmit) < 0 && !scan_gotsig)
 				warn("send");
 			
-			bytes += n;
+			input_wait(in);
+			continue;
+		}
+		st->offset = w->offset;
+		st->line = w->line;
+		n = (uint64_t)cnt * nports;
+		
+		if (ctx->random && n > 0 &&
+		    (perm = perm_open(n, ctx->rnd)) == NULL)
+			err(1, "couldn't randomize scan order");
+		
+		/* Resolve its new targets' next hops before we send. */
+		if (xmit_resolve(st->xmit, w->dsts + sent, cnt - sent) < 0)
+			err(1, "couldn't resolve next hops");
+		
+		for (p = (uint64_t)sent * nports; p < n && !scan_gotsig; p++) {
+			i = perm != NULL ? perm_get(perm, p) : p;
+			bag_index(ctx->ports, i % nports, &port);
+			scan_queue(st, sip, w->dsts[i / nports], port);
+		}
+		sent = cnt;
+		
+		if (perm != NULL)
+			perm = perm_close(perm);
+		
+		if (done) {
+			scan_stamp(st);
 			
-			if (bytes > ctx->tick_bytes * scan_ticks) {
-				if (scan_ticks > 100000) {
-					scan_ticks = 1;
-					bytes = 0;
-				}
-				pause();
+			if (!scan_gotsig) {
+				st->offset = w->next_offset;
+				st->line = w->next_line;
 			}
+			input_put(in, w);
+			sent = 0;
 		}
-		bag_refill(ctx->ports);
 	}
+	input_close(in);
 }
 
+/*
+ * Set up the walk of each interface's targets, less any exclusions. Its
+ * order depends only on our key, so that shards on other hosts walk the
+ * same one.
+ */
 static void
-scan_dst_input(ip_t *ip, struct dscan_ctx *ctx, struct dscan_dif *dif)
+scan_prepare(struct dscan_ctx *ctx)
 {
-	char buf[BUFSIZ];
-	uint32_t n, sip, dip, port, bytes = 0;
-	
-	sip = dif->ifent.intf_addr.addr_ip;
+	struct dscan_dif *dif;
+	const uint32_t *start, *end;
+	uint32_t cnt;
+	uint64_t n;
+
+	if (ctx->excl != NULL &&
+	    excl_ranges(ctx->excl, &start, &end, &cnt) < 0)
+		err(1, "couldn't sort exclusions");
 	
-	while (!scan_gotsig) {
-		if (fgets(buf, sizeof(buf), ctx->input) == NULL) {
-			if (feof(ctx->input) || errno != EINTR)
-				break;
+	TAILQ_FOREACH(dif, &ctx->difs, next) {
+		if (ctx->excl != NULL && ctx->input == NULL &&
+		    bag_del_ranges(dif->dsts, start, end, cnt) < 0)
+			err(1, "couldn't exclude targets");
+		
+		if (bag_count(dif->dsts) == 0 || !ctx->random)
 			continue;
-		}
-		if (buf[0] == '#' || isspace((int)buf[0]))
+		
+		n = (uint64_t)bag_count(dif->dsts) * bag_count(ctx->ports);
+		
+		if (rand_set(ctx->rnd, &ctx->key, sizeof(ctx->key)) < 0 ||
+		    (dif->perm = perm_open(n, ctx->rnd)) == NULL)
+			err(1, "couldn't randomize scan order");
+	}
+}
+
+static void *
+scan_thread(void *arg)
+{
+	struct scan_thread *st = (struct scan_thread *)arg;
+	struct dscan_ctx *ctx = st->ctx;
+	struct dscan_dif *dif;
+	int i = 0;
+	
+	// XXX - have fxn ptr to scan_dst* 
+	for (dif = TAILQ_FIRST(&ctx->difs);
+	    dif != TAILQ_END(&ctx->difs) && !scan_gotsig;
+	    dif = TAILQ_NEXT(dif, next), i++) {
+		st->pos = dif->pos;
+		st->difidx = i;
+		
+		if (bag_count(dif->dsts) == 0)
 			continue;
 		
-		fputs(buf, stdout);
-		strtok(buf, " \t\r\n");
+		if (dif->xsk != NULL)
+			st->xmit = xmit_open_xsk(dif->xsk, &dif->ifent,
+			    ctx->batch);
+		else
+			st->xmit = xmit_open(ctx->engine, &dif->ifent,
+			    ctx->batch);
+		if (st->xmit == NULL)
+			err(1, "couldn't open %s for sending",
+			    dif->ifent.intf_name);
 		
-		if (ip_pton(buf, &dip) == 0) {
-			while (bag_iter(ctx->ports, &port) == 0 &&
-			    !scan_gotsig) {
-				while ((n = scan_send(ip, ctx, sip, dip,
-				    port)) < 0)
-					warn("send");
-				bytes += n;
-				if (bytes > ctx->tick_bytes * scan_ticks) {
-					if (scan_ticks > 100000) {
-						scan_ticks = 1;
-						bytes = 0;
-					}
-					pause();
-				}
-			}
-			bag_refill(ctx->ports);
+		xmit_set_stop(st->xmit, &scan_gotsig);
+		
+		if (xmit_set_sndbuf(st->xmit, ctx->sndbuf) < 0)
+			warn("couldn't set send buffer");
+		
+		if (PACE_LAUNCH(ctx->pacing) &&
+		    xmit_set_txtime(st->xmit, pace_clock(st->pace)) < 0)
+			err(1, "couldn't set launch times on %s",
+			    dif->ifent.intf_name);
+		
+		if (ctx->input != NULL) {
+			scan_dst_input(st, dif);
+		} else {
+			scan_resolve(st, dif);
+			scan_dst(st, dif);
 		}
+		
+		scan_stamp(st);
+		
+		while (xmit_flush(st->xmit) < 0 && !scan_gotsig)
+			warn("send");
+		
+		st->stalls += xmit_stalls(st->xmit);
+		st->unresolved += xmit_unresolved(st->xmit);
+		st->xmit = xmit_close(st->xmit);
 	}
+	if (!scan_gotsig)
+		st->difidx = i;
+	
+	return (NULL);
 }
 
+/*
+ * Save our progress: for each interface, the walk position below which
+ * every probe has been sent. Senders may still have a batch or so
+ * queued behind their positions, so we back off over those until the
+ * final save, when everything's been flushed.
+ */
 static void
-scan_dst_random(ip_t *ip, struct dscan_ctx *ctx, struct dscan_dif *dif)
+scan_checkpoint(struct dscan_ctx *ctx, int final)
 {
-	uint32_t sip, dip, port, fip, fport, n, bytes = 0;
-	int i, j, mod;
-	
-	i = bag_count(dif->dsts);
-	j = bag_count(ctx->ports);
-	
-	/* XXX - ugh, gross hack */
-	if ((mod = i % j) == i && i > 1)
-		mod = j % i;
-	if (mod == 0)
-		bag_add(dif->dsts, 0);
-
-	if (ctx->srcs != NULL)
-		bag_shuffle(ctx->srcs, ctx->rnd);
-	bag_shuffle(dif->dsts, ctx->rnd);
-	bag_shuffle(ctx->ports, ctx->rnd);
-	
-	bag_iter(dif->dsts, &fip);
-	bag_iter(ctx->ports, &fport);
-	dip = fip, port = fport;
-	sip = dif->ifent.intf_addr.addr_ip;
+	struct scan_thread *st;
+	struct dscan_dif *dif;
+	struct ckpt ck;
+	uint64_t *pos, n, p, back;
+	int i, j = 0;
 	
-	do {
-		if (ctx->srcs != NULL) {
-			while (bag_iter(ctx->srcs, &sip) < 0)
-				bag_refill(ctx->srcs);
-			sip = htonl(sip);
-		}
-		if (dip != 0) {
-			while ((n = scan_send(ip, ctx, sip, htonl(dip),
-			    port)) < 0)
-				warn("send");
+	if (ctx->ckpt == NULL)
+		return;
+	
+	TAILQ_FOREACH(dif, &ctx->difs, next) {
+		j++;
+	}
+	if ((pos = calloc(j, sizeof(*pos))) == NULL) {
+		warn("calloc");
+		return;
+	}
+	back = final ? 0 : (uint64_t)(HASH_BATCH + ctx->batch) *
+	    ctx->shards * ctx->threads;
+	
+	j = 0;
+	TAILQ_FOREACH(dif, &ctx->difs, next) {
+		n = (uint64_t)bag_count(dif->dsts) * bag_count(ctx->ports);
+		pos[j] = n;
+		
+		for (i = 0; i < ctx->threads; i++) {
+			st = &scan_threads[i];
 			
-			bytes += n;
-		}
-		if (bytes > ctx->tick_bytes * scan_ticks) {
-			if (scan_ticks > 100000) {
-				scan_ticks = 1;
-				bytes = 0;
-			}
-			pause();
+			if (st->difidx < j) {
+				p = dif->pos;
+			} else if (st->difidx == j) {
+				p = st->pos > back ? st->pos - back : 0;
+				p = MAX(p, dif->pos);
+			} else
+				p = n;
+			
+			pos[j] = MIN(pos[j], p);
 		}
-		while (bag_iter(dif->dsts, &dip) < 0)
-			bag_refill(dif->dsts);
+		j++;
+	}
+	ck.sent = ctx->resume.sent;
+	for (i = 0; i < ctx->threads; i++)
+		ck.sent += scan_threads[i].sent;
+	ck.offset = scan_threads[0].offset;
+	ck.line = scan_threads[0].line;
+	
+	if (ckpt_save(ctx, ctx->ckpt, &ck, pos) < 0)
+		warn("couldn't write checkpoint %s", ctx->ckpt);
+	
+	free(pos);
+}
+
+/*
+ * Checkpoint every SCAN_CKPT_SECS from a thread of our own, whatever
+ * the senders' pacing, and keep the fsync() off their path.
+ */
+static void *
+scan_ckpt_thread(void *arg)
+{
+	struct dscan_ctx *ctx = (struct dscan_ctx *)arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&scan_ckpt_lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += SCAN_CKPT_SECS;
+	
+	while (!scan_ckpt_done) {
+		if (pthread_cond_timedwait(&scan_ckpt_cond, &scan_ckpt_lock,
+		    &ts) != ETIMEDOUT)
+			continue;
 		
-		while (bag_iter(ctx->ports, &port) < 0)
-			bag_refill(ctx->ports);
+		pthread_mutex_unlock(&scan_ckpt_lock);
+		scan_checkpoint(ctx, 0);
+		pthread_mutex_lock(&scan_ckpt_lock);
+		ts.tv_sec += SCAN_CKPT_SECS;
 	}
-	while (!(dip == fip && port == fport) && !scan_gotsig);
+	pthread_mutex_unlock(&scan_ckpt_lock);
+	
+	return (NULL);
+}
+
+static void
+scan_thread_open(struct dscan_ctx *ctx, struct scan_thread *st, int idx)
+{
+	st->ctx = ctx;
+	st->idx = idx;
+	st->offset = ctx->resume.offset;
+	st->line = ctx->resume.line;
+	
+	if ((st->probe = probe_open(ctx->proto, ctx->tcpflags,
+	    ctx->osstack)) == NULL)
+		err(1, "couldn't build probe templates");
+	
+	if ((st->pace = pace_open(ctx->bitrate / ctx->threads,
+	    ctx->burst / ctx->threads, ctx->pacing)) == NULL)
+		err(1, "couldn't set up pacing");
+}
+
+static void
+scan_thread_close(struct scan_thread *st)
+{
+	st->probe = probe_close(st->probe);
+	st->pace = pace_close(st->pace);
 }
 
 static void
 scan_signal(int sig)
 {
-	if (sig == SIGALRM)
-		scan_ticks++;
-	else
-		scan_gotsig++;
+	scan_gotsig++;
 }
 
 #define timeval_to_float_usec(tv)	\
@@ -232,55 +539,110 @@ dscan_scan(struct dscan_ctx *ctx)
 {
 	struct timeval tv;
 	struct dscan_dif *dif;
+	struct scan_thread *threads;
+	pthread_t ckpt;
 	float start, end;
-	int difcnt = 0;
-	ip_t *ip;
+	uint64_t probes = 0, stalls = 0, unresolved = 0;
+	int i;
 	
 	close(ctx->spipe[0]);
 #ifdef HAVE_SETPROCTITLE
 	setproctitle("scan");
 #endif
-	if ((ip = ip_open()) == NULL)
-		err(1, "couldn't open raw socket");
+	if (ctx->input != NULL && ctx->threads > 1) {
+		warnx("reading targets from stdin, using 1 sender thread");
+		ctx->threads = 1;
+	}
+	/* An AF_XDP TX ring takes only one producer. */
+	if (XMIT_ENGINE(ctx->engine) == XMIT_XDP && ctx->threads > 1) {
+		warnx("sending thru AF_XDP, using 1 sender thread");
+		ctx->threads = 1;
+	}
+	scan_prepare(ctx);
 	
 	/* Print our scan configuration. */
 	TAILQ_FOREACH(dif, &ctx->difs, next) {
-		difcnt += bag_count(dif->dsts);
+		probes += (uint64_t)bag_count(dif->dsts) * bag_count(ctx->ports);
+		probes -= MIN(dif->pos, probes);
 	}
-	fprintf(stderr, "Scan starting: key %u", ctx->key);
+	fprintf(stderr, "Scan %s: key %s", ctx->resume.sent > 0 ?
+	    "resuming" : "starting", dscan_get_key(ctx));
+	if (ctx->shards > 1)
+		fprintf(stderr, ", shard %d/%d", ctx->shard + 1, ctx->shards);
 	if (ctx->input == NULL)
 		fprintf(stderr, ", ETA %s",  print_duration((float)
-		    (difcnt * bag_count(ctx->ports) * 48 * 8) / ctx->bitrate));
+		    (probes / ctx->shards) * 48 * 8 / ctx->bitrate));
 	fputc('\n', stderr);
 	
+	if ((threads = calloc(ctx->threads, sizeof(*threads))) == NULL)
+		err(1, "calloc");
+	scan_threads = threads;
+	
+	for (i = 0; i < ctx->threads; i++)
+		scan_thread_open(ctx, &threads[i], i);
+	
 	mysignal(SIGINT, scan_signal);
 	mysignal(SIGTERM, scan_signal);
-	mysignal(SIGALRM, scan_signal);
 	mysignal(SIGPIPE, SIG_IGN);
 	
-	ualarm(ctx->tick_usec, ctx->tick_usec);
-	
 	gettimeofday(&tv, NULL);
 	start = timeval_to_float_usec(&tv);
-
-	// XXX - have fxn ptr to scan_dst* 
-	for (dif = TAILQ_FIRST(&ctx->difs);
-	    dif != TAILQ_END(&ctx->difs) && !scan_gotsig;
-	    dif = TAILQ_NEXT(dif, next)) {
-		if (ctx->random) {
-			scan_dst_random(ip, ctx, dif);
-		} else if (ctx->input != NULL) {
-			scan_dst_input(ip, ctx, dif);
-		} else
-			scan_dst(ip, ctx, dif);
+	
+	/* The first shard is ours. */
+	for (i = 1; i < ctx->threads; i++) {
+		if ((errno = pthread_create(&threads[i].thread, NULL,
+		    scan_thread, &threads[i])) != 0)
+			err(1, "couldn't start sender thread");
+	}
+	if (ctx->ckpt != NULL &&
+	    (errno = pthread_create(&ckpt, NULL, scan_ckpt_thread, ctx)) != 0)
+		err(1, "couldn't start checkpoint thread");
+	
+	scan_thread(&threads[0]);
+	
+	for (i = 1; i < ctx->threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	
+	if (ctx->ckpt != NULL) {
+		pthread_mutex_lock(&scan_ckpt_lock);
+		scan_ckpt_done = 1;
+		pthread_cond_signal(&scan_ckpt_cond);
+		pthread_mutex_unlock(&scan_ckpt_lock);
+		pthread_join(ckpt, NULL);
 	}
+	
 	gettimeofday(&tv, NULL);
 	end = timeval_to_float_usec(&tv);
 	ctx->duration = (end - start) / 1000000.0;
 	
-	ualarm(0, 0);
+	scan_checkpoint(ctx, 1);
 	
-	write(ctx->spipe[1], &ctx->duration, sizeof(ctx->duration));
+	for (i = 0; i < ctx->threads; i++) {
+		stalls += threads[i].stalls;
+		unresolved += threads[i].unresolved;
+	}
+	if (stalls > 0) {
+		fprintf(stderr, "Send queue full, waited %llu times\n",
+		    (unsigned long long)stalls);
+	}
+	if (unresolved > 0) {
+		fprintf(stderr, "No next hop for %llu probes, not sent\n",
+		    (unsigned long long)unresolved);
+	}
+	if (ctx->dedup != NULL) {
+		fprintf(stderr, "Skipped %llu duplicate targets, "
+		    "%llu probes\n", (unsigned long long)dedup_count(ctx->dedup),
+		    (unsigned long long)dedup_count(ctx->dedup) *
+		    bag_count(ctx->ports));
+	}
+	for (i = 0; i < ctx->threads; i++)
+		scan_thread_close(&threads[i]);
+	free(threads);
 	
-	ip_close(ip);
+	TAILQ_FOREACH(dif, &ctx->difs, next) {
+		if (dif->perm != NULL)
+			dif->perm = perm_close(dif->perm);
+	}
+	
+	write(ctx->spipe[1], &ctx->duration, sizeof(ctx->duration));
 }
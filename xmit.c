@@ -0,0 +1,935 @@
+/*
+ * xmit.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#define _GNU_SOURCE		/* XXX - sendmmsg() */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#ifdef __linux__
+# include <sys/mman.h>
+# include <linux/if_packet.h>
+# include <linux/net_tstamp.h>
+# include <net/if.h>
+#endif
+
+#include <dnet.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xsk.h"
+#include "xmit.h"
+
+#define XMIT_POLL		100		/* ms to wait for the socket */
+#define XMIT_WAIT		50000		/* ns to let the device drain */
+
+#if defined(PACKET_TX_RING) || defined(HAVE_LINUX_IF_XDP_H)
+#define XMIT_LINK					/* we frame probes */
+#define XMIT_ARP_TRIES		3
+#define XMIT_ARP_WAIT		(200 * 1000)	/* usec between tries */
+#define XMIT_ARP_WINDOW		512		/* ARPs in flight at once */
+#define XMIT_HOPS_MIN		256		/* initial host table size */
+
+struct xmit_hop {
+	uint32_t		 ip;		/* on-link host or gateway */
+	int			 ok;		/* resolved? */
+	eth_addr_t		 ea;
+};
+
+struct xmit_route {
+	uint32_t		 net;		/* dst prefix */
+	uint32_t		 mask;
+	struct xmit_hop		 gw;		/* ip 0 if on-link */
+};
+#endif
+
+#ifdef PACKET_TX_RING
+#define XMIT_RING_FRAMESZ	128		/* hdr + eth + probe */
+#define XMIT_RING_BLOCKSZ	(64 * 1024)
+#define XMIT_RING_FRAMES	4096
+#define XMIT_RING_DATA		TPACKET_ALIGN(sizeof(struct tpacket2_hdr))
+#endif
+
+#if defined(HAVE_SENDMMSG) && defined(SO_TXTIME)
+#define XMIT_TXTIME
+union xmit_cmsg {
+	char			 buf[CMSG_SPACE(sizeof(uint64_t))];
+	struct cmsghdr		 align;
+};
+#endif
+
+struct xmit {
+	int			 engine;	/* transmit engine */
+	ip_t			*ip;		/* raw IP handle */
+	int			 fd;		/* raw or packet socket */
+	u_char			*pkts;		/* packet vector */
+	int			*lens;		/* packet lengths */
+	int			 off;		/* first unsent packet */
+	int			 cnt;		/* queued packets */
+	int			 batch;		/* max queued packets */
+	uint64_t		 stalls;	/* waits for room to send */
+	volatile uint32_t	*stop;		/* give up waiting when set */
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr		*msgs;
+	struct iovec		*iovs;
+	struct sockaddr_in	*sins;
+#endif
+#ifdef XMIT_TXTIME
+	int			 txtime;	/* stamp launch times */
+	uint64_t		*times;		/* ... for each packet */
+	union xmit_cmsg		*cmsgs;
+#endif
+#ifdef PACKET_TX_RING
+	u_char			*ring;		/* mmap'ed TX ring */
+	int			 ringsz;	/* ring size in bytes */
+	int			 cur;		/* current ring frame */
+#endif
+#ifdef HAVE_LINUX_IF_XDP_H
+	xsk_t			*xsk;		/* AF_XDP socket, not ours */
+	u_char			*frame;		/* current TX frame */
+#endif
+#ifdef XMIT_LINK
+	u_char			 eth[ETH_HDR_LEN]; /* link header, less dst */
+	uint32_t		 ifaddr;	/* our subnet */
+	uint32_t		 ifmask;
+	arp_t			*arp;
+	struct xmit_hop		*hops;		/* on-link hosts, by ip */
+	uint32_t		 nhops;
+	uint32_t		 hopsz;		/* a power of 2 */
+	struct xmit_route	*routes;	/* longest prefix first */
+	int			 nroutes;
+	uint64_t		 unresolved;	/* probes with no next hop */
+#endif
+};
+
+#define XMIT_PKT(x, i)		((x)->pkts + ((i) * XMIT_PKT_MAX))
+
+#define XMIT_FULL(e)		((e) == EAGAIN || (e) == ENOBUFS)
+
+/* Fail with EINTR once we've been told to stop waiting. */
+static int
+_xmit_stopped(xmit_t *x)
+{
+	if (x->stop != NULL && *x->stop) {
+		errno = EINTR;
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Wait for room to send, the same frame again after. A full socket
+ * buffer (EAGAIN) wakes poll(); a full device queue (ENOBUFS) doesn't,
+ * so we give it a moment to drain instead.
+ */
+static int
+_xmit_wait(xmit_t *x)
+{
+	struct timespec ts = { 0, XMIT_WAIT };
+	struct pollfd pfd;
+
+	x->stalls++;
+
+	if (errno == EAGAIN && x->fd >= 0) {
+		pfd.fd = x->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, XMIT_POLL) < 0 && errno != EINTR)
+			return (-1);
+	} else
+		nanosleep(&ts, NULL);
+
+	return (_xmit_stopped(x) ? -1 : 0);
+}
+
+#ifdef XMIT_LINK
+/*
+ * Resolve the link-layer addresses of up to XMIT_ARP_WINDOW next hops
+ * at once, prodding the kernel to ARP for each until it answers or
+ * we've tried enough. Those that don't answer stay unresolved.
+ */
+static void
+_xmit_arp(xmit_t *x, struct xmit_hop **h, int n)
+{
+	struct arp_entry ae;
+	struct sockaddr_in sin;
+	int i, fd, left, tries;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(9);
+
+	for (tries = 0; ; tries++) {
+		for (i = left = 0; i < n; i++) {
+			if (h[i]->ok)
+				continue;
+			addr_pack(&ae.arp_pa, ADDR_TYPE_IP, IP_ADDR_BITS,
+			    &h[i]->ip, IP_ADDR_LEN);
+			if (arp_get(x->arp, &ae) == 0) {
+				memcpy(&h[i]->ea, &ae.arp_ha.addr_eth,
+				    ETH_ADDR_LEN);
+				h[i]->ok = 1;
+			} else if (tries < XMIT_ARP_TRIES && fd >= 0) {
+				sin.sin_addr.s_addr = h[i]->ip;
+				sendto(fd, "", 0, 0, (struct sockaddr *)&sin,
+				    sizeof(sin));
+				left++;
+			}
+		}
+		if (left == 0)
+			break;
+		usleep(XMIT_ARP_WAIT);
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+/* Return ip's slot in the host table, or the empty one it'd go in. */
+static struct xmit_hop *
+_xmit_hop(xmit_t *x, uint32_t ip)
+{
+	uint32_t i, mask = x->hopsz - 1;
+
+	for (i = ntohl(ip) * 2654435761U; ; i++) {
+		if (x->hops[i & mask].ip == ip || x->hops[i & mask].ip == 0)
+			return (&x->hops[i & mask]);
+	}
+}
+
+/* Add an unresolved host, returning 1 if it's new. */
+static int
+_xmit_hop_add(xmit_t *x, uint32_t ip)
+{
+	struct xmit_hop *h, *old = x->hops;
+	uint32_t i, oldsz = x->hopsz;
+
+	/* Keep the table at most half full. */
+	if ((x->nhops + 1) * 2 > x->hopsz) {
+		x->hopsz = x->hopsz ? x->hopsz * 2 : XMIT_HOPS_MIN;
+		if ((x->hops = calloc(x->hopsz, sizeof(*h))) == NULL) {
+			x->hops = old;
+			x->hopsz = oldsz;
+			return (-1);
+		}
+		for (i = 0; i < oldsz; i++) {
+			if (old[i].ip != 0)
+				*_xmit_hop(x, old[i].ip) = old[i];
+		}
+		free(old);
+	}
+	if ((h = _xmit_hop(x, ip))->ip == ip)
+		return (0);
+
+	h->ip = ip;
+	x->nhops++;
+
+	return (1);
+}
+
+/* Return dst's route, the longest prefix matching it. */
+static struct xmit_route *
+_xmit_route(xmit_t *x, uint32_t dst)
+{
+	int i;
+
+	for (i = 0; i < x->nroutes; i++) {
+		if ((dst & x->routes[i].mask) == x->routes[i].net)
+			return (&x->routes[i]);
+	}
+	return (NULL);
+}
+
+/* Is dst on-link: on our subnet, or routed without a gateway? */
+static int
+_xmit_onlink(xmit_t *x, uint32_t dst)
+{
+	struct xmit_route *rt;
+
+	if (((dst ^ x->ifaddr) & x->ifmask) == 0)
+		return (1);
+	
+	return ((rt = _xmit_route(x, dst)) != NULL && rt->gw.ip == 0);
+}
+
+/*
+ * Find the next hop for dst, from what xmit_resolve() or opening us
+ * resolved: itself if it's on-link, else its route's gateway. Never
+ * waits on ARP.
+ */
+static int
+_xmit_nexthop(xmit_t *x, uint32_t dst, eth_addr_t *ea)
+{
+	struct xmit_route *rt;
+	struct xmit_hop *h;
+
+	if (((dst ^ x->ifaddr) & x->ifmask) == 0 ||
+	    ((rt = _xmit_route(x, dst)) != NULL && rt->gw.ip == 0)) {
+		if (x->hopsz == 0 || (h = _xmit_hop(x, dst))->ip != dst)
+			return (-1);
+	} else if (rt != NULL)
+		h = &rt->gw;
+	else
+		return (-1);
+	
+	if (!h->ok)
+		return (-1);
+	
+	memcpy(ea, &h->ea, ETH_ADDR_LEN);
+	return (0);
+}
+
+/*
+ * Address the frame at eth, holding a probe, to its next hop. If there
+ * isn't one, the probe is dropped, as the kernel would have.
+ */
+static int
+_xmit_frame(xmit_t *x, u_char *eth)
+{
+	struct eth_hdr *e = (struct eth_hdr *)eth;
+	struct ip_hdr *ip = (struct ip_hdr *)(eth + ETH_HDR_LEN);
+
+	if (_xmit_nexthop(x, ip->ip_dst, &e->eth_dst) < 0) {
+		x->unresolved++;
+		return (-1);
+	}
+	return (0);
+}
+
+static int
+_xmit_route_add(const struct route_entry *re, void *arg)
+{
+	xmit_t *x = (xmit_t *)arg;
+	struct xmit_route *rt;
+
+	if (re->route_dst.addr_type != ADDR_TYPE_IP)
+		return (0);
+
+	if ((rt = realloc(x->routes, (x->nroutes + 1) *
+	    sizeof(*rt))) == NULL)
+		return (-1);
+	x->routes = rt;
+	rt += x->nroutes++;
+
+	memset(rt, 0, sizeof(*rt));
+	rt->mask = re->route_dst.addr_bits == 0 ? 0 :
+	    htonl(0xffffffffU << (IP_ADDR_BITS - re->route_dst.addr_bits));
+	rt->net = re->route_dst.addr_ip & rt->mask;
+
+	if (re->route_gw.addr_type == ADDR_TYPE_IP)
+		rt->gw.ip = re->route_gw.addr_ip;
+
+	return (0);
+}
+
+static int
+_xmit_route_cmp(const void *a, const void *b)
+{
+	uint32_t ma = ntohl(((const struct xmit_route *)a)->mask);
+	uint32_t mb = ntohl(((const struct xmit_route *)b)->mask);
+
+	return (ma > mb ? -1 : ma < mb);
+}
+
+/*
+ * Take a copy of the routing table, and resolve each route's gateway
+ * if it's on our subnet. Routes thru gateways off it don't leave by
+ * this interface, so probes routed there are dropped.
+ */
+static int
+_xmit_open_routes(xmit_t *x)
+{
+	struct xmit_hop *h[XMIT_ARP_WINDOW];
+	route_t *r;
+	int i, n, ret;
+
+	if ((r = route_open()) == NULL)
+		return (-1);
+	ret = route_loop(r, _xmit_route_add, x);
+	route_close(r);
+
+	if (ret < 0)
+		return (-1);
+
+	qsort(x->routes, x->nroutes, sizeof(x->routes[0]), _xmit_route_cmp);
+	
+	for (i = n = 0; i < x->nroutes; i++) {
+		if (x->routes[i].gw.ip == 0 ||
+		    ((x->routes[i].gw.ip ^ x->ifaddr) & x->ifmask) != 0)
+			continue;
+		h[n++] = &x->routes[i].gw;
+		
+		if (n == XMIT_ARP_WINDOW) {
+			_xmit_arp(x, h, n);
+			n = 0;
+		}
+	}
+	_xmit_arp(x, h, n);
+
+	return (0);
+}
+
+static int
+_xmit_open_link(xmit_t *x, const struct intf_entry *ifent)
+{
+	const struct addr *ia = &ifent->intf_addr;
+
+	if ((x->arp = arp_open()) == NULL)
+		return (-1);
+
+	x->ifaddr = ia->addr_ip;
+	x->ifmask = ia->addr_bits == 0 ? 0 :
+	    htonl(0xffffffffU << (IP_ADDR_BITS - ia->addr_bits));
+
+	if (_xmit_open_routes(x) < 0)
+		return (-1);
+
+	eth_pack_hdr(x->eth, ETH_ADDR_BROADCAST, ifent->intf_link_addr.addr_eth,
+	    ETH_TYPE_IP);
+
+	return (0);
+}
+#endif /* XMIT_LINK */
+
+#ifdef PACKET_TX_RING
+#define XMIT_FRAME(x, i)	\
+	((struct tpacket2_hdr *)((x)->ring + ((i) * XMIT_RING_FRAMESZ)))
+#define XMIT_FRAME_DATA(f)	((u_char *)(f) + XMIT_RING_DATA)
+
+static int
+_xmit_open_ring(xmit_t *x, const struct intf_entry *ifent)
+{
+	struct sockaddr_ll sll;
+	struct tpacket_req req;
+	int i, n;
+
+	if (_xmit_open_link(x, ifent) < 0)
+		return (-1);
+
+	if ((x->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+		return (-1);
+
+	n = TPACKET_V2;
+	if (setsockopt(x->fd, SOL_PACKET, PACKET_VERSION, &n, sizeof(n)) < 0)
+		return (-1);
+#ifdef PACKET_QDISC_BYPASS
+	n = 1;
+	if ((x->engine & XMIT_BYPASS) &&
+	    setsockopt(x->fd, SOL_PACKET, PACKET_QDISC_BYPASS,
+		&n, sizeof(n)) < 0)
+		return (-1);
+#endif
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = XMIT_RING_BLOCKSZ;
+	req.tp_frame_size = XMIT_RING_FRAMESZ;
+	req.tp_frame_nr = XMIT_RING_FRAMES;
+	req.tp_block_nr = (XMIT_RING_FRAMES * XMIT_RING_FRAMESZ) /
+	    XMIT_RING_BLOCKSZ;
+
+	if (setsockopt(x->fd, SOL_PACKET, PACKET_TX_RING,
+		&req, sizeof(req)) < 0)
+		return (-1);
+
+	x->ringsz = req.tp_block_size * req.tp_block_nr;
+
+	if ((x->ring = mmap(NULL, x->ringsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, x->fd, 0)) == MAP_FAILED) {
+		x->ring = NULL;
+		return (-1);
+	}
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = if_nametoindex(ifent->intf_name);
+
+	if (bind(x->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+		return (-1);
+
+	/* Every frame carries our link header, to each probe's next hop. */
+	for (i = 0; i < XMIT_RING_FRAMES; i++)
+		memcpy(XMIT_FRAME_DATA(XMIT_FRAME(x, i)), x->eth, ETH_HDR_LEN);
+
+	/* Kick the kernel at most every ring's worth of frames. */
+	if (x->batch > XMIT_RING_FRAMES)
+		x->batch = XMIT_RING_FRAMES;
+
+	return (0);
+}
+
+static u_char *
+_xmit_buf_ring(xmit_t *x)
+{
+	struct tpacket2_hdr *f = XMIT_FRAME(x, x->cur);
+	struct pollfd pfd;
+
+	/* Wait for the kernel to give us back this frame. */
+	while (f->tp_status != TP_STATUS_AVAILABLE) {
+		if (f->tp_status == TP_STATUS_WRONG_FORMAT) {
+			f->tp_status = TP_STATUS_AVAILABLE;
+			break;
+		}
+		if (xmit_flush(x) < 0)
+			return (NULL);
+
+		x->stalls++;
+		pfd.fd = x->fd;
+		pfd.events = POLLOUT;
+		if ((poll(&pfd, 1, XMIT_POLL) < 0 && errno != EINTR) ||
+		    _xmit_stopped(x))
+			return (NULL);
+	}
+	return (XMIT_FRAME_DATA(f) + ETH_HDR_LEN);
+}
+
+static int
+_xmit_add_ring(xmit_t *x, int len)
+{
+	struct tpacket2_hdr *f = XMIT_FRAME(x, x->cur);
+
+	/* Leave the frame for the next probe if this one can't go. */
+	if (_xmit_frame(x, XMIT_FRAME_DATA(f)) < 0)
+		return (0);
+
+	f->tp_len = ETH_HDR_LEN + len;
+	f->tp_status = TP_STATUS_SEND_REQUEST;
+
+	x->cur = (x->cur + 1) % XMIT_RING_FRAMES;
+	x->cnt++;
+
+	return (len);
+}
+
+static int
+_xmit_flush_ring(xmit_t *x)
+{
+	/* If the ring's backed up, xmit_buf() waits for its frames. */
+	while (send(x->fd, NULL, 0, MSG_DONTWAIT) < 0) {
+		if (XMIT_FULL(errno))
+			break;
+		if (errno != EINTR)
+			return (-1);
+	}
+	return (0);
+}
+#endif /* PACKET_TX_RING */
+
+#ifdef HAVE_LINUX_IF_XDP_H
+static u_char *
+_xmit_buf_xsk(xmit_t *x)
+{
+	struct pollfd pfd;
+	u_char *p;
+
+	/* Wait for the kernel to give us back a frame. */
+	while ((p = xsk_tx_buf(x->xsk)) == NULL) {
+		if (xsk_tx_kick(x->xsk) < 0 && errno != EAGAIN)
+			return (NULL);
+
+		x->stalls++;
+		pfd.fd = xsk_fd(x->xsk);
+		pfd.events = POLLOUT;
+		if ((poll(&pfd, 1, XMIT_POLL) < 0 && errno != EINTR) ||
+		    _xmit_stopped(x))
+			return (NULL);
+	}
+	memcpy(p, x->eth, ETH_HDR_LEN);
+	x->frame = p;
+
+	return (p + ETH_HDR_LEN);
+}
+#endif
+
+xmit_t *
+xmit_open(int engine, const struct intf_entry *ifent, int batch)
+{
+	xmit_t *x;
+#ifdef HAVE_SENDMMSG
+	int n = 1;
+#endif
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		return (NULL);
+
+	x->engine = engine;
+	x->fd = -1;
+	x->batch = batch > 1 ? batch : 1;
+
+	if (XMIT_ENGINE(engine) == XMIT_RING) {
+#ifdef PACKET_TX_RING
+		if (_xmit_open_ring(x, ifent) < 0)
+			return (xmit_close(x));
+		return (x);
+#else
+		errno = EOPNOTSUPP;
+		return (xmit_close(x));
+#endif
+	}
+	if ((x->pkts = calloc(x->batch, XMIT_PKT_MAX)) == NULL ||
+	    (x->lens = calloc(x->batch, sizeof(x->lens[0]))) == NULL)
+		return (xmit_close(x));
+#ifdef HAVE_SENDMMSG
+	/* Our own raw socket, even unbatched, so we can size it. */
+	if ((x->msgs = calloc(x->batch, sizeof(x->msgs[0]))) == NULL ||
+	    (x->iovs = calloc(x->batch, sizeof(x->iovs[0]))) == NULL ||
+	    (x->sins = calloc(x->batch, sizeof(x->sins[0]))) == NULL)
+		return (xmit_close(x));
+
+	/* Non-blocking, so a full send buffer is ours to wait out. */
+	if ((x->fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0 ||
+	    setsockopt(x->fd, IPPROTO_IP, IP_HDRINCL, &n, sizeof(n)) < 0 ||
+	    setsockopt(x->fd, SOL_SOCKET, SO_BROADCAST, &n, sizeof(n)) < 0 ||
+	    fcntl(x->fd, F_SETFL, fcntl(x->fd, F_GETFL) | O_NONBLOCK) < 0)
+		return (xmit_close(x));
+
+	return (x);
+#else
+	if ((x->ip = ip_open()) == NULL)
+		return (xmit_close(x));
+
+	return (x);
+#endif
+}
+
+/*
+ * Send thru an AF_XDP socket from xsk_open(), shared with the receiver
+ * and still open after we're closed.
+ */
+xmit_t *
+xmit_open_xsk(xsk_t *xsk, const struct intf_entry *ifent, int batch)
+{
+#ifdef HAVE_LINUX_IF_XDP_H
+	xmit_t *x;
+
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		return (NULL);
+
+	x->engine = XMIT_XDP;
+	x->fd = -1;
+	x->batch = batch > 1 ? batch : 1;
+	x->xsk = xsk;
+
+	if (_xmit_open_link(x, ifent) < 0)
+		return (xmit_close(x));
+
+	return (x);
+#else
+	errno = EOPNOTSUPP;
+	return (NULL);
+#endif
+}
+
+u_char *
+xmit_buf(xmit_t *x)
+{
+	if (x->cnt == x->batch && xmit_flush(x) < 0)
+		return (NULL);
+#ifdef PACKET_TX_RING
+	if (x->ring != NULL)
+		return (_xmit_buf_ring(x));
+#endif
+#ifdef HAVE_LINUX_IF_XDP_H
+	if (x->xsk != NULL)
+		return (_xmit_buf_xsk(x));
+#endif
+	return (XMIT_PKT(x, x->cnt));
+}
+
+/* Queue a packet to leave at a launch time, from xmit_set_txtime(). */
+int
+xmit_add_at(xmit_t *x, int len, uint64_t when)
+{
+#ifdef XMIT_TXTIME
+	if (x->txtime)
+		x->times[x->cnt] = when;
+#endif
+	return (xmit_add(x, len));
+}
+
+int
+xmit_add(xmit_t *x, int len)
+{
+#ifdef PACKET_TX_RING
+	if (x->ring != NULL)
+		return (_xmit_add_ring(x, len));
+#endif
+#ifdef HAVE_LINUX_IF_XDP_H
+	if (x->xsk != NULL) {
+		if (_xmit_frame(x, x->frame) < 0)
+			return (0);
+		xsk_tx_add(x->xsk, ETH_HDR_LEN + len);
+	} else
+#endif
+	x->lens[x->cnt] = len;
+	x->cnt++;
+
+	if (x->batch == 1 && xmit_flush(x) < 0)
+		return (-1);
+
+	return (len);
+}
+
+#ifdef HAVE_SENDMMSG
+static int
+_xmit_flush_mmsg(xmit_t *x)
+{
+	struct ip_hdr *ip;
+#ifdef XMIT_TXTIME
+	struct cmsghdr *cm;
+#endif
+	int i, n;
+
+	for (i = x->off; i < x->cnt; i++) {
+		ip = (struct ip_hdr *)XMIT_PKT(x, i);
+
+		x->sins[i].sin_family = AF_INET;
+		x->sins[i].sin_addr.s_addr = ip->ip_dst;
+		x->iovs[i].iov_base = ip;
+		x->iovs[i].iov_len = x->lens[i];
+		x->msgs[i].msg_hdr.msg_name = &x->sins[i];
+		x->msgs[i].msg_hdr.msg_namelen = sizeof(x->sins[i]);
+		x->msgs[i].msg_hdr.msg_iov = &x->iovs[i];
+		x->msgs[i].msg_hdr.msg_iovlen = 1;
+#ifdef XMIT_TXTIME
+		if (x->txtime) {
+			x->msgs[i].msg_hdr.msg_control = x->cmsgs[i].buf;
+			x->msgs[i].msg_hdr.msg_controllen =
+			    sizeof(x->cmsgs[i].buf);
+			cm = CMSG_FIRSTHDR(&x->msgs[i].msg_hdr);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_TXTIME;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+			memcpy(CMSG_DATA(cm), &x->times[i], sizeof(uint64_t));
+		}
+#endif
+	}
+	while (x->off < x->cnt) {
+		if ((n = sendmmsg(x->fd, &x->msgs[x->off],
+		    x->cnt - x->off, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (XMIT_FULL(errno)) {
+				if (_xmit_wait(x) < 0)
+					return (-1);
+				continue;
+			}
+			/* Drop the probe we can't send, not the rest. */
+			x->off++;
+			return (-1);
+		}
+		x->off += n;
+	}
+	return (0);
+}
+#endif
+
+int
+xmit_flush(xmit_t *x)
+{
+#ifdef PACKET_TX_RING
+	if (x->ring != NULL) {
+		if (_xmit_flush_ring(x) < 0)
+			return (-1);
+	} else
+#endif
+#ifdef HAVE_LINUX_IF_XDP_H
+	if (x->xsk != NULL) {
+		while (xsk_tx_kick(x->xsk) < 0) {
+			if (errno != EAGAIN || _xmit_wait(x) < 0)
+				return (-1);
+		}
+	} else
+#endif
+#ifdef HAVE_SENDMMSG
+	if (x->fd >= 0) {
+		if (_xmit_flush_mmsg(x) < 0)
+			return (-1);
+	} else
+#endif
+	for ( ; x->off < x->cnt; x->off++) {
+		while (ip_send(x->ip, XMIT_PKT(x, x->off),
+		    x->lens[x->off]) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!XMIT_FULL(errno)) {
+				x->off++;
+				return (-1);
+			}
+			/* Keep the probe if we're only told to stop. */
+			if (_xmit_wait(x) < 0)
+				return (-1);
+		}
+	}
+	x->off = x->cnt = 0;
+
+	return (0);
+}
+
+/*
+ * Size the socket's send buffer, past the sysctl limit if we're
+ * allowed. A no-op for the libdnet IP handle.
+ */
+int
+xmit_set_sndbuf(xmit_t *x, int size)
+{
+	if (x->fd < 0 || size <= 0)
+		return (0);
+#ifdef SO_SNDBUFFORCE
+	if (setsockopt(x->fd, SOL_SOCKET, SO_SNDBUFFORCE,
+		&size, sizeof(size)) == 0)
+		return (0);
+#endif
+	return (setsockopt(x->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)));
+}
+
+/*
+ * Have the qdisc (fq, or etf) hold each packet until its launch time,
+ * on the given clock. Needs our own raw socket: a TX ring frame has
+ * nowhere to carry one.
+ */
+int
+xmit_set_txtime(xmit_t *x, int clock)
+{
+#ifdef XMIT_TXTIME
+	struct sock_txtime st;
+
+	if (x->fd < 0 || XMIT_ENGINE(x->engine) != XMIT_IP) {
+		errno = EOPNOTSUPP;
+		return (-1);
+	}
+	if ((x->times = calloc(x->batch, sizeof(x->times[0]))) == NULL ||
+	    (x->cmsgs = calloc(x->batch, sizeof(x->cmsgs[0]))) == NULL)
+		return (-1);
+
+	memset(&st, 0, sizeof(st));
+	st.clockid = clock;
+
+	if (setsockopt(x->fd, SOL_SOCKET, SO_TXTIME, &st, sizeof(st)) < 0)
+		return (-1);
+
+	x->txtime = 1;
+	return (0);
+#else
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+/* Give up waiting for room to send once *stop is set. */
+void
+xmit_set_stop(xmit_t *x, volatile uint32_t *stop)
+{
+	x->stop = stop;
+}
+
+/* Return the count of waits for room to send. */
+uint64_t
+xmit_stalls(xmit_t *x)
+{
+	return (x->stalls);
+}
+
+/*
+ * Resolve the next hops of on-link dsts, a window of them at a time,
+ * before we send to them. Hosts already tried aren't tried again, and
+ * off-link dsts go to their route's gateway, resolved when we opened.
+ */
+int
+xmit_resolve(xmit_t *x, const uint32_t *dsts, int n)
+{
+#ifdef XMIT_LINK
+	struct xmit_hop *h[XMIT_ARP_WINDOW];
+	uint32_t ips[XMIT_ARP_WINDOW];
+	int i, j, k, ret;
+
+	if (x->arp == NULL)
+		return (0);
+	
+	for (i = 0; i < n; ) {
+		/* Add this window's new hosts, then look them up again. */
+		for (k = 0; i < n && k < XMIT_ARP_WINDOW; i++) {
+			if (!_xmit_onlink(x, dsts[i]))
+				continue;
+			if ((ret = _xmit_hop_add(x, dsts[i])) < 0)
+				return (-1);
+			if (ret > 0)
+				ips[k++] = dsts[i];
+		}
+		for (j = 0; j < k; j++)
+			h[j] = _xmit_hop(x, ips[j]);
+		
+		_xmit_arp(x, h, k);
+	}
+#endif
+	return (0);
+}
+
+/* Return the count of probes dropped for want of a next hop. */
+uint64_t
+xmit_unresolved(xmit_t *x)
+{
+#ifdef XMIT_LINK
+	return (x->unresolved);
+#else
+	return (0);
+#endif
+}
+
+xmit_t *
+xmit_close(xmit_t *x)
+{
+#ifdef PACKET_TX_RING
+	if (x->ring != NULL) {
+		/* Drain the ring before we tear it down. */
+		send(x->fd, NULL, 0, 0);
+		munmap(x->ring, x->ringsz);
+	}
+#endif
+#ifdef XMIT_LINK
+	if (x->arp != NULL)
+		arp_close(x->arp);
+	if (x->hops != NULL)
+		free(x->hops);
+	if (x->routes != NULL)
+		free(x->routes);
+#endif
+	if (x->ip != NULL)
+		ip_close(x->ip);
+	if (x->fd >= 0)
+		close(x->fd);
+#ifdef HAVE_SENDMMSG
+	if (x->msgs != NULL)
+		free(x->msgs);
+	if (x->iovs != NULL)
+		free(x->iovs);
+	if (x->sins != NULL)
+		free(x->sins);
+#endif
+#ifdef XMIT_TXTIME
+	if (x->times != NULL)
+		free(x->times);
+	if (x->cmsgs != NULL)
+		free(x->cmsgs);
+#endif
+	if (x->lens != NULL)
+		free(x->lens);
+	if (x->pkts != NULL)
+		free(x->pkts);
+	free(x);
+
+	return (NULL);
+}
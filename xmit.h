@@ -0,0 +1,37 @@
+/*
+ * xmit.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef XMIT_H
+#define XMIT_H
+
+#define XMIT_PKT_MAX	64	/* largest probe we build */
+
+#define XMIT_IP		0	/* raw IP socket */
+#define XMIT_RING	1	/* AF_PACKET TX ring */
+#define XMIT_XDP	2	/* AF_XDP TX ring */
+#define XMIT_BYPASS	0x100	/* bypass qdisc (ring only) */
+
+#define XMIT_ENGINE(e)	((e) & 0xff)
+
+typedef struct xmit xmit_t;
+
+xmit_t	*xmit_open(int engine, const struct intf_entry *ifent, int batch);
+xmit_t	*xmit_open_xsk(xsk_t *xsk, const struct intf_entry *ifent, int batch);
+u_char	*xmit_buf(xmit_t *x);
+int	 xmit_add(xmit_t *x, int len);
+int	 xmit_add_at(xmit_t *x, int len, uint64_t when);
+int	 xmit_flush(xmit_t *x);
+int	 xmit_resolve(xmit_t *x, const uint32_t *dsts, int n);
+int	 xmit_set_sndbuf(xmit_t *x, int size);
+int	 xmit_set_txtime(xmit_t *x, int clock);
+void	 xmit_set_stop(xmit_t *x, volatile uint32_t *stop);
+uint64_t xmit_stalls(xmit_t *x);
+uint64_t xmit_unresolved(xmit_t *x);
+xmit_t	*xmit_close(xmit_t *x);
+
+#endif /* XMIT_H */
@@ -0,0 +1,502 @@
+/*
+ * xsk.c
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef HAVE_LINUX_IF_XDP_H
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <linux/bpf.h>
+# include <linux/if_link.h>
+# include <linux/if_xdp.h>
+# include <net/if.h>
+# include <netinet/in.h>
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xsk.h"
+
+#ifdef HAVE_LINUX_IF_XDP_H
+#define XSK_FRAMESZ	2048			/* UMEM chunk size */
+#define XSK_RX_FRAMES	2048			/* ... for the receiver */
+#define XSK_TX_FRAMES	2048			/* ... and for the sender */
+#define XSK_FRAMES	(XSK_RX_FRAMES + XSK_TX_FRAMES)
+#define XSK_QUEUES	64			/* XSKMAP entries */
+#define XSK_ECHO_LEN	36			/* probe.c's echo request */
+#define XSK_KICK_TRIES	64			/* EAGAINs before we give up */
+
+#define xsk_barrier()	__sync_synchronize()
+
+/*
+ * An AF_XDP socket, in copy (generic) mode so any driver will do, with
+ * an XDP program steering scan replies into it. It's opened before the
+ * scan and recv processes fork, with its UMEM and rings shared between
+ * them, and each side keeps to its own rings: the receiver to RX and
+ * fill, the sender to TX and completion. Every ring then still has a
+ * single producer and a single consumer, and needs no lock.
+ */
+struct xsk_ring {
+	volatile uint32_t	*prod;
+	volatile uint32_t	*cons;
+	void			*descs;
+	uint32_t		 mask;
+	void			*map;		/* mmap'ed ring */
+	size_t			 mapsz;
+};
+
+struct xsk {
+	int			 fd;		/* AF_XDP socket */
+	int			 map_fd;	/* XSKMAP */
+	int			 prog_fd;	/* XDP program */
+	int			 link_fd;	/* ... its XDP link */
+	u_char			*umem;
+	struct xsk_ring		 rx;
+	struct xsk_ring		 fill;
+	struct xsk_ring		 tx;
+	struct xsk_ring		 comp;
+	uint32_t		 tx_prod;	/* TX descs queued */
+	uint32_t		 tx_done;	/* TX frames completed */
+};
+
+#define XSK_RX_DESC(x, i)	(&((struct xdp_desc *)(x)->rx.descs)	\
+				    [(i) & (x)->rx.mask])
+#define XSK_TX_DESC(x, i)	(&((struct xdp_desc *)(x)->tx.descs)	\
+				    [(i) & (x)->tx.mask])
+#define XSK_ADDR(r, i)		(&((uint64_t *)(r)->descs)[(i) & (r)->mask])
+#define XSK_TX_ADDR(i)		\
+	((uint64_t)(XSK_RX_FRAMES + ((i) % XSK_TX_FRAMES)) * XSK_FRAMESZ)
+
+#define XSK_INSN(c, d, s, o, i)	\
+	((struct bpf_insn){ (c), (d), (s), (o), (i) })
+#define XSK_LDX(sz, d, s, o)	XSK_INSN(BPF_LDX | BPF_MEM | (sz), d, s, o, 0)
+#define XSK_STX(sz, d, s, o)	XSK_INSN(BPF_STX | BPF_MEM | (sz), d, s, o, 0)
+#define XSK_JMP(op, d, i, o) XSK_INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+
+/*
+ * Redirect replies to our probes to the socket bound to the receiving
+ * queue, and pass everything else up the stack: IPv4 to addr (any, if
+ * 0), either a TCP SYN-ACK no socket of ours is waiting for, or an
+ * ICMP echo reply the length of our echo request.
+ */
+static int
+_xsk_prog(int map_fd, uint32_t addr)
+{
+	struct bpf_insn prog[] = {
+		/* r6 = ctx, r2 = data, r3 = data_end */
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1,
+		    0, 0),
+		XSK_LDX(BPF_W, BPF_REG_2, BPF_REG_6, 0),
+		XSK_LDX(BPF_W, BPF_REG_3, BPF_REG_6, 4),
+		/* eth + ip + icmp[0] in bounds? */
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2,
+		    0, 0),
+		XSK_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 35),
+		XSK_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3,
+		    40, 0),
+		/* ETH_TYPE_IP, without IP options */
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 12),
+		XSK_JMP(BPF_JNE, BPF_REG_4, 0x08, 38),
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 13),
+		XSK_JMP(BPF_JNE, BPF_REG_4, 0x00, 36),
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 14),
+		XSK_JMP(BPF_JNE, BPF_REG_4, 0x45, 34),
+		/* ip_dst = addr */
+		XSK_LDX(BPF_W, BPF_REG_4, BPF_REG_2, 30),
+		addr != 0 ?
+		    XSK_INSN(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_4, 0, 32,
+			(int32_t)addr) :
+		    XSK_JMP(BPF_JA, 0, 0, 0),
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 23),
+		XSK_JMP(BPF_JEQ, BPF_REG_4, IPPROTO_ICMP, 23),
+		XSK_JMP(BPF_JNE, BPF_REG_4, IPPROTO_TCP, 29),
+		/* tcp[13] in bounds, and = 0x12 */
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2,
+		    0, 0),
+		XSK_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 48),
+		XSK_INSN(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3,
+		    26, 0),
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 47),
+		XSK_JMP(BPF_JNE, BPF_REG_4, 0x12, 24),
+		/* sk_lookup_tcp(ctx, {src, dst, sport, dport}, 12, ...) */
+		XSK_LDX(BPF_W, BPF_REG_4, BPF_REG_2, 26),
+		XSK_STX(BPF_W, BPF_REG_10, BPF_REG_4, -16),
+		XSK_LDX(BPF_W, BPF_REG_4, BPF_REG_2, 30),
+		XSK_STX(BPF_W, BPF_REG_10, BPF_REG_4, -12),
+		XSK_LDX(BPF_W, BPF_REG_4, BPF_REG_2, 34),
+		XSK_STX(BPF_W, BPF_REG_10, BPF_REG_4, -8),
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6,
+		    0, 0),
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10,
+		    0, 0),
+		XSK_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -16),
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, 12),
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0,
+		    BPF_F_CURRENT_NETNS),
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, 0),
+		XSK_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+		    BPF_FUNC_sk_lookup_tcp),
+		/* no socket: it's ours. Else sk_release() and pass. */
+		XSK_JMP(BPF_JEQ, BPF_REG_0, 0, 12),
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_0,
+		    0, 0),
+		XSK_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_release),
+		XSK_JMP(BPF_JA, 0, 0, 7),
+		/* icmp[0] = 0, and ip_len = our echo */
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 34),
+		XSK_JMP(BPF_JNE, BPF_REG_4, 0, 5),
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 16),
+		XSK_JMP(BPF_JNE, BPF_REG_4, XSK_ECHO_LEN >> 8, 3),
+		XSK_LDX(BPF_B, BPF_REG_4, BPF_REG_2, 17),
+		XSK_JMP(BPF_JNE, BPF_REG_4, XSK_ECHO_LEN & 0xff, 1),
+		XSK_JMP(BPF_JA, 0, 0, 2),
+		/* pass: */
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0,
+		    XDP_PASS),
+		XSK_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* redirect_map(map, rx_queue_index, XDP_PASS) */
+		XSK_LDX(BPF_W, BPF_REG_2, BPF_REG_6, 16),
+		XSK_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1,
+		    BPF_PSEUDO_MAP_FD, 0, map_fd),
+		XSK_INSN(0, 0, 0, 0, 0),
+		XSK_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0,
+		    XDP_PASS),
+		XSK_INSN(BPF_JMP | BPF_CALL, 0, 0, 0,
+		    BPF_FUNC_redirect_map),
+		XSK_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uint64_t)(u_long)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uint64_t)(u_long)"BSD";
+
+	return (syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr)));
+}
+
+static int
+_xsk_attach(xsk_t *x, int ifindex, int queue, uint32_t addr)
+{
+	union bpf_attr attr;
+	uint32_t key = queue, val = x->fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(key);
+	attr.value_size = sizeof(val);
+	attr.max_entries = XSK_QUEUES;
+
+	if ((x->map_fd = syscall(__NR_bpf, BPF_MAP_CREATE, &attr,
+	    sizeof(attr))) < 0)
+		return (-1);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = x->map_fd;
+	attr.key = (uint64_t)(u_long)&key;
+	attr.value = (uint64_t)(u_long)&val;
+
+	if (syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)) < 0)
+		return (-1);
+
+	if ((x->prog_fd = _xsk_prog(x->map_fd, addr)) < 0)
+		return (-1);
+
+	/* Detached for us when the last process with it open exits. */
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = x->prog_fd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+
+	if ((x->link_fd = syscall(__NR_bpf, BPF_LINK_CREATE, &attr,
+	    sizeof(attr))) < 0)
+		return (-1);
+
+	return (0);
+}
+
+static int
+_xsk_ring(xsk_t *x, struct xsk_ring *r, uint32_t n,
+    const struct xdp_ring_offset *off, off_t pgoff, size_t descsz)
+{
+	u_char *p;
+
+	r->mapsz = off->desc + n * descsz;
+
+	if ((p = mmap(NULL, r->mapsz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, x->fd, pgoff)) == MAP_FAILED)
+		return (-1);
+
+	r->map = p;
+	r->prod = (uint32_t *)(p + off->producer);
+	r->cons = (uint32_t *)(p + off->consumer);
+	r->descs = p + off->desc;
+	r->mask = n - 1;
+
+	return (0);
+}
+
+xsk_t *
+xsk_open(const char *name, int queue, uint32_t addr)
+{
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sxdp;
+	socklen_t len;
+	xsk_t *x;
+	uint32_t i, n;
+	int ifindex;
+
+	if ((ifindex = if_nametoindex(name)) == 0)
+		return (NULL);
+
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		return (NULL);
+
+	x->fd = x->map_fd = x->prog_fd = x->link_fd = -1;
+
+	/* Shared, so it's the same memory on both sides of the fork. */
+	if ((x->umem = mmap(NULL, XSK_FRAMES * XSK_FRAMESZ,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) ==
+	    MAP_FAILED) {
+		x->umem = NULL;
+		return (xsk_close(x));
+	}
+	if ((x->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0)
+		return (xsk_close(x));
+
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uint64_t)(u_long)x->umem;
+	reg.len = XSK_FRAMES * XSK_FRAMESZ;
+	reg.chunk_size = XSK_FRAMESZ;
+
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+		return (xsk_close(x));
+
+	/* Ring sizes must be set before we can ask where they are. */
+	n = XSK_RX_FRAMES;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof(n)) < 0)
+		return (xsk_close(x));
+	n = XSK_TX_FRAMES;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+	    &n, sizeof(n)) < 0)
+		return (xsk_close(x));
+	n = XSK_RX_FRAMES;
+	if (setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &n, sizeof(n)) < 0)
+		return (xsk_close(x));
+	n = XSK_TX_FRAMES;
+	if (setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &n, sizeof(n)) < 0)
+		return (xsk_close(x));
+
+	len = sizeof(off);
+	if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) < 0)
+		return (xsk_close(x));
+
+	if (_xsk_ring(x, &x->fill, XSK_RX_FRAMES, &off.fr,
+		XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) < 0 ||
+	    _xsk_ring(x, &x->comp, XSK_TX_FRAMES, &off.cr,
+		XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) < 0 ||
+	    _xsk_ring(x, &x->rx, XSK_RX_FRAMES, &off.rx,
+		XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) < 0 ||
+	    _xsk_ring(x, &x->tx, XSK_TX_FRAMES, &off.tx,
+		XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)) < 0)
+		return (xsk_close(x));
+
+	/* Hand the kernel all of the receiver's frames. */
+	for (i = 0; i < XSK_RX_FRAMES; i++)
+		*XSK_ADDR(&x->fill, i) = (uint64_t)i * XSK_FRAMESZ;
+	xsk_barrier();
+	*x->fill.prod = XSK_RX_FRAMES;
+
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = XDP_COPY;
+
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0 ||
+	    _xsk_attach(x, ifindex, queue, addr) < 0)
+		return (xsk_close(x));
+
+	return (x);
+}
+
+int
+xsk_fd(xsk_t *x)
+{
+	return (x->fd);
+}
+
+/* Return the next free TX frame, or NULL if they're all in flight. */
+u_char *
+xsk_tx_buf(xsk_t *x)
+{
+	uint32_t prod, cons;
+
+	/* Frames go out and come back in order, so we need only count. */
+	prod = *x->comp.prod;
+	xsk_barrier();
+	cons = *x->comp.cons;
+
+	if (prod != cons) {
+		x->tx_done += prod - cons;
+		xsk_barrier();
+		*x->comp.cons = prod;
+	}
+	if (x->tx_prod - x->tx_done == XSK_TX_FRAMES)
+		return (NULL);
+
+	return (x->umem + XSK_TX_ADDR(x->tx_prod));
+}
+
+/* Queue the frame from xsk_tx_buf(), to go on the next kick. */
+void
+xsk_tx_add(xsk_t *x, int len)
+{
+	struct xdp_desc *d = XSK_TX_DESC(x, x->tx_prod);
+
+	d->addr = XSK_TX_ADDR(x->tx_prod);
+	d->len = len;
+	d->options = 0;
+	x->tx_prod++;
+}
+
+/*
+ * Have the kernel send our queued frames. Fails with EAGAIN if it
+ * keeps putting us off, for the caller to wait out.
+ */
+int
+xsk_tx_kick(xsk_t *x)
+{
+	int tries = 0;
+
+	xsk_barrier();
+	*x->tx.prod = x->tx_prod;
+
+	/* In copy mode, each send takes a few dozen frames at most. */
+	while (*x->tx.cons != x->tx_prod) {
+		if (sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				if (++tries == XSK_KICK_TRIES)
+					return (-1);
+				continue;
+			}
+			if (errno == EBUSY || errno == ENOBUFS)
+				break;
+			return (-1);
+		}
+		tries = 0;
+	}
+	return (0);
+}
+
+/* Pass each packet received to callback, and give its frame back. */
+int
+xsk_recv(xsk_t *x, xsk_handler callback, void *arg)
+{
+	struct xdp_desc *d;
+	uint32_t prod, cons, fill;
+	int n;
+
+	prod = *x->rx.prod;
+	xsk_barrier();
+	cons = *x->rx.cons;
+	fill = *x->fill.prod;
+
+	for (n = 0; cons != prod; cons++, fill++, n++) {
+		d = XSK_RX_DESC(x, cons);
+		callback(arg, x->umem + d->addr, d->len);
+		*XSK_ADDR(&x->fill, fill) = d->addr & ~(XSK_FRAMESZ - 1ULL);
+	}
+	xsk_barrier();
+	*x->rx.cons = cons;
+	*x->fill.prod = fill;
+
+	return (n);
+}
+
+xsk_t *
+xsk_close(xsk_t *x)
+{
+	struct xsk_ring *r[] = { &x->rx, &x->fill, &x->tx, &x->comp };
+	int i;
+
+	if (x->link_fd >= 0)
+		close(x->link_fd);
+	if (x->prog_fd >= 0)
+		close(x->prog_fd);
+	if (x->map_fd >= 0)
+		close(x->map_fd);
+
+	for (i = 0; i < 4; i++) {
+		if (r[i]->map != NULL)
+			munmap(r[i]->map, r[i]->mapsz);
+	}
+	if (x->fd >= 0)
+		close(x->fd);
+	if (x->umem != NULL)
+		munmap(x->umem, XSK_FRAMES * XSK_FRAMESZ);
+	free(x);
+
+	return (NULL);
+}
+#else /* !HAVE_LINUX_IF_XDP_H */
+xsk_t *
+xsk_open(const char *name, int queue, uint32_t addr)
+{
+	errno = EOPNOTSUPP;
+	return (NULL);
+}
+
+int
+xsk_fd(xsk_t *x)
+{
+	return (-1);
+}
+
+u_char *
+xsk_tx_buf(xsk_t *x)
+{
+	return (NULL);
+}
+
+void
+xsk_tx_add(xsk_t *x, int len)
+{
+}
+
+int
+xsk_tx_kick(xsk_t *x)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+int
+xsk_recv(xsk_t *x, xsk_handler callback, void *arg)
+{
+	return (0);
+}
+
+xsk_t *
+xsk_close(xsk_t *x)
+{
+	return (NULL);
+}
+#endif /* HAVE_LINUX_IF_XDP_H */
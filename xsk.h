@@ -0,0 +1,27 @@
+/*
+ * xsk.h
+ *
+ * Copyright (c) 2002 Dug Song <dugsong@monkey.org>
+ *
+ * $Id$
+ */
+
+#ifndef XSK_H
+#define XSK_H
+
+typedef struct xsk xsk_t;
+
+typedef void (*xsk_handler)(void *arg, const u_char *pkt, int len);
+
+xsk_t	*xsk_open(const char *name, int queue, uint32_t addr);
+int	 xsk_fd(xsk_t *x);
+
+u_char	*xsk_tx_buf(xsk_t *x);
+void	 xsk_tx_add(xsk_t *x, int len);
+int	 xsk_tx_kick(xsk_t *x);
+
+int	 xsk_recv(xsk_t *x, xsk_handler callback, void *arg);
+
+xsk_t	*xsk_close(xsk_t *x);
+
+#endif /* XSK_H */